@@ -21,25 +21,106 @@ LUAMEMLIB_API char *luamem_newalloc (lua_State *L, size_t l) {
 	return mem;
 }
 
+/*
+** {======================================================
+** External memory pressure
+** =======================================================
+*/
+
+/* default bytes allocated by memories between collection steps */
+#if !defined(LUAMEM_PRESSURE)
+#define LUAMEM_PRESSURE	(1 << 20)
+#endif
+
+typedef struct luamem_Pressure {
+	size_t total;  /* bytes currently allocated by 'luamem_realloc' */
+	size_t debt;  /* bytes allocated since the last collection step */
+	size_t threshold;  /* 'debt' that triggers a collection step */
+} luamem_Pressure;
+
+static const char pressurekey = 'p';
+
+static luamem_Pressure *getpressure (lua_State *L, int create) {
+	luamem_Pressure *p;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &pressurekey);
+	p = (luamem_Pressure *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (p == NULL && create) {
+		p = (luamem_Pressure *)lua_newuserdata(L, sizeof(luamem_Pressure));
+		p->total = 0;
+		p->debt = 0;
+		p->threshold = LUAMEM_PRESSURE;
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &pressurekey);
+	}
+	return p;
+}
+
+LUAMEMLIB_API void luamem_account (lua_State *L, size_t osize, size_t nsize) {
+	luamem_Pressure *p = getpressure(L, 0);
+	if (p) {
+		if (nsize > osize) {
+			p->total += nsize - osize;
+			p->debt += nsize - osize;
+		}
+		else p->total -= (osize - nsize < p->total) ? osize - nsize : p->total;
+	}
+}
+
+/*
+** Performs a collection step accounting for the memory allocated since the
+** last one, so the collector keeps the pace with memories that are much
+** larger than their userdata. It is only called when a reference is
+** created, where finalizers might run anyway (as in any allocation of a
+** userdata), and not while blocks are being changed.
+*/
+static void checkpressure (lua_State *L) {
+	luamem_Pressure *p = getpressure(L, 0);
+	if (p && p->threshold && p->debt >= p->threshold) {
+		size_t kbytes = p->debt / 1024;
+		p->debt = 0;
+		lua_gc(L, LUA_GCSTEP, kbytes > INT_MAX ? INT_MAX : (int)kbytes);
+	}
+}
+
+LUAMEMLIB_API size_t luamem_allocated (lua_State *L) {
+	luamem_Pressure *p = getpressure(L, 0);
+	return p ? p->total : 0;
+}
+
+LUAMEMLIB_API size_t luamem_setpressure (lua_State *L, size_t threshold) {
+	luamem_Pressure *p = getpressure(L, 1);
+	size_t old = p->threshold;
+	p->threshold = threshold;
+	return old;
+}
+
+/* }====================================================== */
+
+
 typedef struct luamem_Ref {
 	char *mem;
 	size_t len;
 	luamem_Unref unref;
+	int pending;  /* number of pending operations using the block */
 } luamem_Ref;
 
 #define unref(L,r)	if (r->unref) ref->unref(L, r->mem, r->len)
 
 static int luaunref (lua_State *L) {
 	luamem_Ref *ref = (luamem_Ref *)luaL_testudata(L, 1, LUAMEM_REF);
-	if (ref) unref(L, ref);
+	if (ref && ref->pending == 0) unref(L, ref);  /* otherwise it leaks */
 	return 0;
 }
 
 LUAMEMLIB_API void luamem_newref (lua_State *L) {
-	luamem_Ref *ref = (luamem_Ref *)lua_newuserdata(L, sizeof(luamem_Ref));
+	luamem_Ref *ref;
+	getpressure(L, 1);  /* account memory of the references */
+	checkpressure(L);
+	ref = (luamem_Ref *)lua_newuserdata(L, sizeof(luamem_Ref));
 	ref->mem = NULL;
 	ref->len = 0;
 	ref->unref = NULL;
+	ref->pending = 0;
 	if (luaL_newmetatable(L, LUAMEM_REF)) {
 		lua_pushcfunction(L, luaunref);
 		lua_setfield(L, -2, "__gc");
@@ -51,6 +132,8 @@ LUAMEMLIB_API int luamem_setref (lua_State *L, int idx,
                                  char *mem, size_t len, luamem_Unref unref) {
 	luamem_Ref *ref = (luamem_Ref *)luaL_testudata(L, idx, LUAMEM_REF);
 	if (ref) {
+		if (ref->pending > 0 && (mem != ref->mem || len != ref->len))
+			luaL_error(L, "memory in use by pending operations");
 		if (mem != ref->mem) {
 			unref(L, ref);
 			ref->mem = mem;
@@ -62,6 +145,15 @@ LUAMEMLIB_API int luamem_setref (lua_State *L, int idx,
 	return 0;
 }
 
+LUAMEMLIB_API int luamem_pending (lua_State *L, int idx, int n) {
+	luamem_Ref *ref = (luamem_Ref *)luaL_testudata(L, idx, LUAMEM_REF);
+	if (ref) {
+		ref->pending += n;
+		return ref->pending;
+	}
+	return 0;
+}
+
 LUAMEMLIB_API int luamem_type (lua_State *L, int idx) {
 	int type = LUAMEM_TNONE;
 	if (lua_type(L, idx) == LUA_TUSERDATA) {
@@ -150,7 +242,9 @@ LUAMEMLIB_API void *luamem_realloc(lua_State *L, void *mem, size_t osize,
                                                             size_t nsize) {
 	void *userdata;
 	lua_Alloc alloc = lua_getallocf(L, &userdata);
-	return alloc(userdata, mem, osize, nsize);
+	void *res = alloc(userdata, mem, osize, nsize);
+	if (res || nsize == 0) luamem_account(L, mem ? osize : 0, nsize);
+	return res;
 }
 
 LUAMEMLIB_API void luamem_free(lua_State *L, void *mem, size_t size) {
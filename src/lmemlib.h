@@ -31,6 +31,7 @@ typedef void (*luamem_Unref) (lua_State *L, void *mem, size_t len);
 LUAMEMLIB_API void (luamem_newref) (lua_State *L);
 LUAMEMLIB_API int (luamem_setref) (lua_State *L, int idx,
                                    char *mem, size_t len, luamem_Unref unref);
+LUAMEMLIB_API int (luamem_pending) (lua_State *L, int idx, int n);
 
 LUAMEMLIB_API int (luamem_type) (lua_State *L, int idx);
 
@@ -52,6 +53,9 @@ LUAMEMLIB_API const char *(luamem_optstring) (lua_State *L, int arg, const char
 LUAMEMLIB_API void *(luamem_realloc) (lua_State *L, void *mem, size_t osize,
                                                                size_t nsize);
 LUAMEMLIB_API void (luamem_free) (lua_State *L, void *memo, size_t size);
+LUAMEMLIB_API void (luamem_account) (lua_State *L, size_t osize, size_t nsize);
+LUAMEMLIB_API size_t (luamem_allocated) (lua_State *L);
+LUAMEMLIB_API size_t (luamem_setpressure) (lua_State *L, size_t threshold);
 LUAMEMLIB_API size_t (luamem_checklenarg) (lua_State *L, int idx);
 
 
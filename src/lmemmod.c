@@ -10,12 +10,780 @@
 #endif /* _KERNEL */
 #include <lualib.h>
 
+#if !defined(_KERNEL) && (defined(LUA_USE_LINUX) || defined(LUA_USE_MACOSX))
+#define LUAMEM_USE_THREADS
+#define LUAMEM_USE_MMAP
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/syscall.h>
+#if defined(SYS_memfd_create)
+#define LUAMEM_USE_MEMFD
+#endif
+#if defined(SYS_io_uring_setup) && defined(SYS_io_uring_enter)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_RW_CUR_POS)  /* otherwise use only threads */
+#define LUAMEM_USE_IOURING
+#endif
+#endif
+#endif
+#define LUAMEM_USE_AIO
+#include <errno.h>
+#endif
+
+#if defined(LUAMEM_PROFILE)
+#if defined(_KERNEL)
+#include <linux/timex.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+#if !defined(_KERNEL) && defined(__SSE2__)
+#define LUAMEM_USE_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#define LUAMEM_USE_SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
+
 static lua_Integer posrelat (lua_Integer pos, size_t len);
 static int str2byte (lua_State *L, const char *s, size_t l);
 static void code2char (lua_State *L, int idx, char *p, lua_Integer n);
 static const char *lmemfind (const char *s1, size_t l1,
                              const char *s2, size_t l2);
 
+/*
+** {======================================================
+** PARALLEL EXECUTION
+** =======================================================
+*/
+
+/* size of a cache line, used to avoid false sharing */
+#define CACHELINE	64
+
+/* maximum number of threads used to process a single operation */
+#define MAXTHREADS	64
+
+/* default minimum size to process an operation in parallel */
+#define PARMINSIZE	((size_t)1 << 22)
+
+/*
+** Function that processes chunk 'i' of 'n' equal parts of an operation.
+*/
+typedef void (*TaskFunc) (void *ud, size_t i, size_t n);
+
+/* offset of the beginning of chunk 'i' of 'n' parts of 'size' bytes */
+static size_t chunkpos (size_t size, size_t n, size_t i) {
+	if (i >= n) return size;
+	return (size / n * i) & ~(size_t)(CACHELINE - 1);
+}
+
+#ifdef LUAMEM_USE_THREADS
+
+typedef struct Task {
+	TaskFunc f;
+	void *ud;
+	size_t n;  /* number of chunks */
+	size_t next;  /* next chunk to be processed */
+} Task;
+
+typedef struct Worker {
+	pthread_t thread;
+	unsigned long gen;  /* generation of the last task seen */
+} Worker;
+
+/*
+** Pool of threads shared by all Lua states in the process. Field 'busy'
+** is held during a task, so concurrent operations simply run serially.
+*/
+static struct {
+	pthread_mutex_t lock;
+	pthread_mutex_t busy;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	Task *task;
+	unsigned long gen;  /* incremented for each new task */
+	int active;  /* number of workers still processing the current task */
+	int nworkers;
+	int nstates;  /* number of Lua states using the library */
+	size_t minsize;
+	Worker workers[MAXTHREADS-1];
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	NULL, 0, 0, 0, 0, PARMINSIZE
+};
+
+static void runtask (Task *task) {
+	size_t i;
+	while ((i = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED)) < task->n)
+		task->f(task->ud, i, task->n);
+}
+
+static void *workermain (void *arg) {
+	Worker *w = (Worker *)arg;
+	int id = (int)(w - pool.workers);
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (w->gen == pool.gen && id < pool.nworkers)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		if (id >= pool.nworkers) break;
+		w->gen = pool.gen;
+		pthread_mutex_unlock(&pool.lock);
+		runtask(pool.task);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.active == 0)
+			pthread_cond_signal(&pool.finish);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+/*
+** Changes the number of worker threads. Returns the number of workers
+** actually available.
+*/
+static int setworkers (int n) {
+	int i, old;
+	pthread_mutex_lock(&pool.busy);
+	pthread_mutex_lock(&pool.lock);
+	old = pool.nworkers;
+	pool.nworkers = n;
+	if (n < old) pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = n; i < old; i++)  /* wait for the removed workers */
+		pthread_join(pool.workers[i].thread, NULL);
+	for (i = old; i < n; i++) {
+		pool.workers[i].gen = pool.gen;
+		if (pthread_create(&pool.workers[i].thread, NULL, workermain,
+		                   &pool.workers[i]) != 0) {
+			pthread_mutex_lock(&pool.lock);
+			pool.nworkers = i;
+			pthread_cond_broadcast(&pool.start);
+			pthread_mutex_unlock(&pool.lock);
+			n = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool.busy);
+	return n;
+}
+
+/*
+** Calls 'f' for each chunk of an operation over 'size' bytes, using the
+** pool threads when the operation is large enough.
+*/
+static void parallel (TaskFunc f, void *ud, size_t size) {
+	int nworkers = __atomic_load_n(&pool.nworkers, __ATOMIC_RELAXED);
+	if (nworkers > 0 &&
+	    size >= __atomic_load_n(&pool.minsize, __ATOMIC_RELAXED) &&
+	    pthread_mutex_trylock(&pool.busy) == 0) {
+		Task task;
+		pthread_mutex_lock(&pool.lock);
+		task.f = f;
+		task.ud = ud;
+		task.n = (size_t)pool.nworkers + 1;
+		task.next = 0;
+		pool.task = &task;
+		pool.active = pool.nworkers;
+		pool.gen++;
+		pthread_cond_broadcast(&pool.start);
+		pthread_mutex_unlock(&pool.lock);
+		runtask(&task);
+		pthread_mutex_lock(&pool.lock);
+		while (pool.active > 0)
+			pthread_cond_wait(&pool.finish, &pool.lock);
+		pool.task = NULL;
+		pthread_mutex_unlock(&pool.lock);
+		pthread_mutex_unlock(&pool.busy);
+	}
+	else f(ud, 0, 1);
+}
+
+#define LUAMEM_POOL	"luamem_Pool"
+
+static const char poolkey = 'P';
+
+/*
+** Each Lua state that loads the library keeps in its registry a value
+** whose finalizer stops the workers when the last of these states is
+** closed, as the library might be unloaded right after that.
+*/
+static int releasepool (lua_State *L) {
+	int last;
+	(void)L;
+	pthread_mutex_lock(&pool.lock);
+	last = (--pool.nstates == 0);
+	pthread_mutex_unlock(&pool.lock);
+	if (last) setworkers(0);
+	return 0;
+}
+
+static void usepool (lua_State *L) {
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &poolkey) == LUA_TNIL) {
+		lua_newuserdata(L, 0);
+		if (luaL_newmetatable(L, LUAMEM_POOL)) {
+			lua_pushcfunction(L, releasepool);
+			lua_setfield(L, -2, "__gc");
+		}
+		lua_setmetatable(L, -2);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &poolkey);
+		pthread_mutex_lock(&pool.lock);
+		pool.nstates++;
+		pthread_mutex_unlock(&pool.lock);
+	}
+	lua_pop(L, 1);
+}
+
+#else /* LUAMEM_USE_THREADS */
+
+static size_t parminsize = PARMINSIZE;
+
+#define parallel(f,ud,size)	((void)(size), (f)(ud, 0, 1))
+
+#endif /* LUAMEM_USE_THREADS */
+
+
+typedef struct RangeTask {
+	char *mem;
+	const char *s;
+	size_t size;
+	size_t len;  /* size of 's', or the result for comparisons */
+} RangeTask;
+
+static void settask (void *ud, size_t i, size_t n) {
+	RangeTask *t = (RangeTask *)ud;
+	size_t b = chunkpos(t->size, n, i), e = chunkpos(t->size, n, i+1);
+	memset(t->mem + b, *t->s, (e - b) * sizeof(char));
+}
+
+static void copytask (void *ud, size_t i, size_t n) {
+	RangeTask *t = (RangeTask *)ud;
+	size_t b = chunkpos(t->size, n, i), e = chunkpos(t->size, n, i+1);
+	memcpy(t->mem + b, t->s + b, (e - b) * sizeof(char));
+}
+
+/*
+** Finds the first differing byte in chunk, and keeps the lowest index
+** found among all chunks in 't->len'.
+*/
+static void difftask (void *ud, size_t i, size_t n) {
+	RangeTask *t = (RangeTask *)ud;
+	size_t b = chunkpos(t->size, n, i), e = chunkpos(t->size, n, i+1);
+	const char *s1 = t->mem, *s2 = t->s;
+	while (b < e) {
+		size_t l = e - b < 4096 ? e - b : 4096;
+		if (b >= __atomic_load_n(&t->len, __ATOMIC_RELAXED))
+			return;  /* a previous difference was found */
+		if (memcmp(s1 + b, s2 + b, l * sizeof(char)) != 0) {
+			size_t found;
+			while (s1[b] == s2[b]) b++;
+			found = __atomic_load_n(&t->len, __ATOMIC_RELAXED);
+			while (b < found && !__atomic_compare_exchange_n(&t->len, &found, b,
+			                      0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			return;
+		}
+		b += l;
+	}
+}
+
+/* sets 'size' bytes in 'mem' with value 'c' */
+static void memsetpar (char *mem, char c, size_t size) {
+	RangeTask t;
+	t.mem = mem;
+	t.s = &c;
+	t.size = size;
+	parallel(settask, &t, size);
+}
+
+/* copies 'size' bytes from 's' to 'mem', which must not overlap */
+static void memcpypar (char *mem, const char *s, size_t size) {
+	RangeTask t;
+	t.mem = mem;
+	t.s = s;
+	t.size = size;
+	parallel(copytask, &t, size);
+}
+
+/* returns the index of the first different byte of 's1' and 's2' */
+static size_t memdiffpar (const char *s1, const char *s2, size_t size) {
+	RangeTask t;
+	t.mem = (char *)s1;
+	t.s = s2;
+	t.size = size;
+	t.len = size;
+	parallel(difftask, &t, size);
+	return t.len;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** MAPPED MEMORY
+** =======================================================
+*/
+
+/* minimum size of memories created with pages mapped on demand */
+#if !defined(LUAMEM_MAPSIZE)
+#define LUAMEM_MAPSIZE	(1 << 20)
+#endif
+
+#ifdef LUAMEM_USE_MMAP
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+static void unmapmem (lua_State *L, void *mem, size_t len) {
+	if (mem) {
+		munmap(mem, len);
+		luamem_account(L, len, 0);
+	}
+}
+
+#ifdef LUAMEM_USE_MEMFD
+
+#if !defined(MFD_CLOEXEC)
+#define MFD_CLOEXEC	0x0001U
+#endif
+
+#if !defined(FALLOC_FL_PUNCH_HOLE)
+#define FALLOC_FL_KEEP_SIZE	0x01
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+/*
+** Memories mapped from files are private mappings of regions of an
+** anonymous file (memfd) shared by all these memories of a Lua state, so
+** they take a single file descriptor. A region is only changed to take
+** snapshots of its memory. Table in the registry at 'mapfileskey' maps
+** the address of each of these memories to the 'MapRegion' of its region,
+** which counts the memories that map it.
+*/
+typedef struct MapFile {
+	int fd;  /* or -1 when closed */
+	off_t size;  /* end of the last region */
+} MapFile;
+
+typedef struct MapRegion {
+	MapFile *file;
+	off_t offset;
+	int count;  /* number of memories mapping the region */
+} MapRegion;
+
+#define LUAMEM_MAPFILE	"luamem_MapFile"
+
+static const char mapfileskey = 'f';
+static const char mapfilekey = 'F';
+
+static int closemapfile (lua_State *L) {
+	MapFile *mf = (MapFile *)lua_touserdata(L, 1);
+	if (mf->fd >= 0) close(mf->fd);
+	mf->fd = -1;
+	return 0;
+}
+
+/*
+** Returns the file shared by the memories mapped from a file, creating it
+** if necessary, or returns NULL if it cannot be created.
+*/
+static MapFile *getmapfile (lua_State *L) {
+	MapFile *mf;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &mapfilekey);
+	mf = (MapFile *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (mf == NULL) {
+		int fd = (int)syscall(SYS_memfd_create, "luamem", MFD_CLOEXEC);
+		if (fd < 0) return NULL;
+		mf = (MapFile *)lua_newuserdata(L, sizeof(MapFile));
+		mf->fd = fd;
+		mf->size = 0;
+		if (luaL_newmetatable(L, LUAMEM_MAPFILE)) {
+			lua_pushcfunction(L, closemapfile);
+			lua_setfield(L, -2, "__gc");
+		}
+		lua_setmetatable(L, -2);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &mapfilekey);
+	}
+	return mf;
+}
+
+static void pushmapfiles (lua_State *L) {
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &mapfileskey) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &mapfileskey);
+	}
+}
+
+/*
+** Pushes the 'MapRegion' of memory 'mem' onto the stack and returns it,
+** or returns NULL if it is not mapped from a file.
+*/
+static MapRegion *pushmapregion (lua_State *L, void *mem) {
+	pushmapfiles(L);
+	lua_rawgetp(L, -1, mem);
+	lua_remove(L, -2);
+	return (MapRegion *)lua_touserdata(L, -1);
+}
+
+static size_t pagesize (size_t len) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	return (len + page - 1) / page * page;
+}
+
+static void unmapfile (lua_State *L, void *mem, size_t len) {
+	if (mem) {
+		MapRegion *mr = pushmapregion(L, mem);
+		if (mr && --mr->count == 0 && mr->file->fd >= 0) {
+#if defined(SYS_fallocate)
+			/* release the pages of the region in the file */
+			syscall(SYS_fallocate, mr->file->fd,
+			        FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			        mr->offset, (off_t)pagesize(len));
+#endif
+		}
+		lua_pop(L, 1);
+		pushmapfiles(L);
+		lua_pushnil(L);
+		lua_rawsetp(L, -2, mem);
+		lua_pop(L, 1);
+		munmap(mem, len);
+		luamem_account(L, len, 0);
+	}
+}
+
+/*
+** Pushes a new fixed-size memory which is a private mapping of 'len'
+** bytes of the region of the 'MapRegion' at index 'arg', or of a new
+** region if 'arg' is zero. Returns NULL (pushing nothing) if the mapping
+** fails.
+*/
+static char *mapfile (lua_State *L, int arg, size_t len) {
+	MapRegion *mr;
+	void *mem;
+	if (arg == 0) {  /* create a new region at the end of the file */
+		MapFile *mf = getmapfile(L);
+		off_t size;
+		if (mf == NULL || mf->fd < 0) return NULL;
+		size = mf->size + (off_t)pagesize(len);
+		if (ftruncate(mf->fd, size) != 0) return NULL;
+		mr = (MapRegion *)lua_newuserdata(L, sizeof(MapRegion));
+		mr->file = mf;
+		mr->offset = mf->size;
+		mr->count = 0;
+		mf->size = size;
+	}
+	else {
+		lua_pushvalue(L, arg);
+		mr = (MapRegion *)lua_touserdata(L, -1);
+	}
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, mr->file->fd,
+	           mr->offset);
+	if (mem == MAP_FAILED) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	mr->count++;
+	pushmapfiles(L);
+	lua_insert(L, -2);
+	lua_rawsetp(L, -2, mem);  /* mapfiles[mem] = mr */
+	lua_pop(L, 1);
+	luamem_newref(L);
+	luamem_account(L, 0, len);
+	luamem_setref(L, -1, (char *)mem, len, unmapfile);
+	return (char *)mem;
+}
+
+/*
+** Table in the registry at 'concurrentkey' counts, for each memory mapped
+** from a file that might be written by other threads (because it is used
+** by a ring), the uses that allow it. The modified pages of these memories,
+** or of memories with pending asynchronous operations, are never discarded,
+** as writes by the other threads in the meantime would be lost.
+*/
+static const char concurrentkey = 'c';
+
+static int pushconcurrent (lua_State *L, int idx) {
+	luamem_Unref unref;
+	luamem_tomemoryx(L, idx, NULL, &unref, NULL);
+	if (unref != unmapfile) return 0;
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &concurrentkey) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &concurrentkey);
+	}
+	return 1;
+}
+
+/* adds 'n' to the uses of the memory at index 'idx' by other threads */
+static void markconcurrent (lua_State *L, int idx, int n) {
+	idx = lua_absindex(L, idx);
+	if (pushconcurrent(L, idx)) {
+		lua_Integer count;
+		lua_pushvalue(L, idx);
+		lua_rawget(L, -2);
+		count = lua_tointeger(L, -1) + n;
+		lua_pop(L, 1);
+		lua_pushvalue(L, idx);
+		if (count > 0) lua_pushinteger(L, count);
+		else lua_pushnil(L);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+}
+
+static int isconcurrent (lua_State *L, int idx) {
+	int res = (luamem_pending(L, idx, 0) > 0);  /* pending reads write it */
+	idx = lua_absindex(L, idx);
+	if (!res && pushconcurrent(L, idx)) {
+		lua_pushvalue(L, idx);
+		res = (lua_rawget(L, -2) != LUA_TNIL);
+		lua_pop(L, 2);
+	}
+	return res;
+}
+
+/* bits of the entries of '/proc/self/pagemap' */
+#define PM_PRESENT	((unsigned long long)1 << 63)
+#define PM_SWAP	((unsigned long long)1 << 62)
+#define PM_FILE	((unsigned long long)1 << 61)
+
+/*
+** Marks in 'dirty' the pages of 'len' bytes from 'mem' that are not pages
+** of the file mapped by it (that is, pages copied on write). All pages
+** are marked if this information is not available.
+*/
+static void finddirty (const char *mem, size_t len, size_t page,
+                       unsigned char *dirty) {
+	size_t i = 0, n = (len + page - 1) / page;
+	int fd = open("/proc/self/pagemap", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		unsigned long long entries[512];
+		off_t offset = (off_t)((size_t)mem / page * sizeof(entries[0]));
+		while (i < n) {
+			size_t j, k = n - i < 512 ? n - i : 512;
+			size_t size = k * sizeof(entries[0]);
+			if (pread(fd, entries, size, offset) != (ssize_t)size) break;
+			for (j = 0; j < k; j++) {
+				unsigned long long e = entries[j];
+				dirty[i+j] = (e & PM_SWAP) || ((e & PM_PRESENT) && !(e & PM_FILE));
+			}
+			offset += size;
+			i += k;
+		}
+		close(fd);
+	}
+	if (i < n) memset(dirty + i, 1, n - i);
+}
+
+/*
+** Writes the pages marked in 'dirty' of the 'len' bytes of 'mem' to the
+** region of 'mr' and discards them, so 'mem' maps the region unchanged
+** again. Returns 0 if the file cannot be written.
+*/
+static int syncdirty (MapRegion *mr, char *mem, size_t len, size_t page,
+                      const unsigned char *dirty) {
+	size_t i, n = (len + page - 1) / page;
+	for (i = 0; i < n; i++) if (dirty[i]) {
+		size_t j = i, off, size;
+		while (j < n && dirty[j]) j++;  /* find run of dirty pages */
+		off = i * page;
+		size = (j * page < len ? j * page : len) - off;
+		while (size > 0) {
+			ssize_t written = pwrite(mr->file->fd, mem + off, size,
+			                         mr->offset + (off_t)off);
+			if (written <= 0) return 0;
+			off += (size_t)written;
+			size -= (size_t)written;
+		}
+		madvise(mem + i * page, (j - i) * page, MADV_DONTNEED);
+		i = j;
+	}
+	return 1;
+}
+
+/*
+** Pushes a snapshot of memory 'mem' of 'len' bytes mapped from a file at
+** index 'arg', which maps the same region, so pages are shared until
+** written. If 'mem' is the only mapping of the region and it is not
+** written by other threads, its modified pages are written to the region
+** (and discarded from 'mem'), otherwise they are copied to the snapshot.
+** Returns 0 (pushing nothing) if the snapshot cannot be mapped.
+*/
+static int snapshotfile (lua_State *L, int arg, char *mem, size_t len) {
+	size_t i, n, page = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char *dirty;
+	int synced;
+	char *snap;
+	MapRegion *mr = pushmapregion(L, mem);
+	if (mr == NULL || mr->file->fd < 0) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	n = (len + page - 1) / page;
+	dirty = (unsigned char *)lua_newuserdata(L, n);
+	finddirty(mem, len, page, dirty);
+	synced = (mr->count == 1 && !isconcurrent(L, arg) &&
+	          syncdirty(mr, mem, len, page, dirty));
+	snap = mapfile(L, -2, len);
+	if (snap == NULL) {
+		lua_pop(L, 2);
+		return 0;
+	}
+	if (!synced) for (i = 0; i < n; i++) if (dirty[i]) {
+		size_t off = i * page;
+		memcpy(snap + off, mem + off, len - off < page ? len - off : page);
+	}
+	lua_replace(L, -3);  /* replace 'MapRegion' by the snapshot */
+	lua_pop(L, 1);  /* remove 'dirty' */
+	return 1;
+}
+
+#endif /* LUAMEM_USE_MEMFD */
+
+/*
+** Creates a fixed-size memory with 'len' bytes of pages obtained zeroed
+** from the system, which are only backed by physical memory when touched.
+** Returns NULL if the pages cannot be mapped.
+*/
+static char *newmapped (lua_State *L, size_t len) {
+	void *mem;
+#ifdef LUAMEM_USE_MEMFD
+	if ((mem = mapfile(L, 0, len)) != NULL) return (char *)mem;
+#endif
+	luamem_newref(L);
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	luamem_account(L, 0, len);
+	luamem_setref(L, -1, (char *)mem, len, unmapmem);
+	return (char *)mem;
+}
+
+/* size of huge pages mapped with 'MAP_HUGETLB' */
+#if !defined(LUAMEM_HUGEPAGESIZE)
+#define LUAMEM_HUGEPAGESIZE	((size_t)1 << 21)
+#endif
+
+#define alignup(n,a)	(((n) + (a) - 1) & ~((a) - 1))
+
+static void unmaphuge (lua_State *L, void *mem, size_t len) {
+	if (mem) {
+		munmap(mem, alignup(len, LUAMEM_HUGEPAGESIZE));
+		luamem_account(L, len, 0);
+	}
+}
+
+/*
+** Creates a fixed-size memory with 'len' zeroed bytes whose address is a
+** multiple of 'align', which must be a power of 2. If 'huge' is true, the
+** memory is preferably backed by huge pages, either reserved ones or
+** transparent ones (by advice to the system).
+*/
+static char *newaligned (lua_State *L, size_t len, size_t align, int huge) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size, extra;
+	char *mem, *p;
+	if (align < page) align = page;
+	if (huge && align < LUAMEM_HUGEPAGESIZE) align = LUAMEM_HUGEPAGESIZE;
+	luamem_newref(L);
+	if (len == 0) {
+		luamem_setref(L, -1, NULL, 0, unmapmem);
+		return NULL;
+	}
+#ifdef MAP_HUGETLB
+	if (huge && len <= LUAMEM_MAXALLOC - LUAMEM_HUGEPAGESIZE) {
+		size = alignup(len, LUAMEM_HUGEPAGESIZE);
+		mem = (char *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+		                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (mem != (char *)MAP_FAILED) {
+			if (((size_t)mem & (align - 1)) == 0) {
+				luamem_account(L, 0, len);
+				luamem_setref(L, -1, mem, len, unmaphuge);
+				return mem;
+			}
+			munmap(mem, size);
+		}
+	}
+#endif
+	size = alignup(len, page);
+	extra = align - page;  /* to find an aligned address in the mapping */
+	if (len > LUAMEM_MAXALLOC - page || size > LUAMEM_MAXALLOC - extra)
+		luaL_error(L, "memory too large");
+	mem = (char *)mmap(NULL, size + extra, PROT_READ|PROT_WRITE,
+	                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == (char *)MAP_FAILED) luaL_error(L, "out of memory");
+	p = (char *)alignup((size_t)mem, align);
+	if (p > mem) munmap(mem, p - mem);  /* release the unaligned head */
+	if (p + size < mem + size + extra)  /* and the tail */
+		munmap(p + size, (mem + size + extra) - (p + size));
+#ifdef MADV_HUGEPAGE
+	if (huge) madvise(p, size, MADV_HUGEPAGE);
+#endif
+	luamem_account(L, 0, len);
+	luamem_setref(L, -1, p, len, unmapmem);
+	return p;
+}
+
+#ifdef LUAMEM_USE_MEMFD
+#define ismapped(U)	((U) == unmapmem || (U) == unmaphuge || (U) == unmapfile)
+#else
+#define ismapped(U)	((U) == unmapmem || (U) == unmaphuge)
+#endif
+
+#else /* LUAMEM_USE_MMAP */
+
+#define newmapped(L,l)	NULL
+#define newaligned(L,l,a,h)	\
+	((void)(a), (void)(h), luaL_error(L, "aligned memory not supported"))
+#define ismapped(U)	0
+
+#endif /* LUAMEM_USE_MMAP */
+
+#ifndef LUAMEM_USE_MEMFD
+#define markconcurrent(L,i,n)	((void)0)
+#endif
+
+/*
+** Gets the alignment ('align', which must be a power of 2) and huge page
+** ('hugepages') options for creation of a memory from table at 'arg'.
+*/
+static int getalignopts (lua_State *L, int arg, size_t *align) {
+	lua_Integer n;
+	int huge;
+	luaL_checktype(L, arg, LUA_TTABLE);
+	lua_getfield(L, arg, "align");
+	n = luaL_optinteger(L, -1, 1);
+	luaL_argcheck(L, 0 < n && (n & (n - 1)) == 0 &&
+	                 n <= (lua_Integer)(LUAMEM_MAXALLOC/2 + 1), arg,
+	                 "alignment must be a power of 2");
+	lua_getfield(L, arg, "hugepages");
+	huge = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	*align = (size_t)n;
+	return huge;
+}
+
+/* }====================================================== */
+
+
 static int mem_create (lua_State *L) {
 	if (lua_gettop(L) == 0) {
 		luamem_newref(L);
@@ -26,6 +794,14 @@ static int mem_create (lua_State *L) {
 		const char *s = NULL;
 		if (lua_type(L, 1) == LUA_TNUMBER) {
 			len = luamem_checklenarg(L, 1);
+			if (!lua_isnoneornil(L, 2)) {
+				size_t align;
+				int huge = getalignopts(L, 2, &align);
+				newaligned(L, len, align, huge);
+				return 1;
+			}
+			if (len >= LUAMEM_MAPSIZE && newmapped(L, len))
+				return 1;  /* pages are already zeroed */
 		} else {
 			lua_Integer posi, pose;
 			s = luamem_checkstring(L, 1, &len);
@@ -44,59 +820,246 @@ static int mem_create (lua_State *L) {
 			}
 		}
 		p = luamem_newalloc(L, len);
-		if (s) memcpy(p, s, len*sizeof(char));
-		else memset(p, 0, len*sizeof(char));
+		if (s) memcpypar(p, s, len);
+		else memsetpar(p, 0, len);
 	}
 	return 1;
 }
 
-static void memfill (char *mem, size_t size, const char *s, size_t len) {
-	do {
-		size_t n = size < len ? size : len;
+/*
+** Fills 'size' bytes of 'mem' with copies of 's', starting from byte
+** 'phase' of 's'.
+*/
+static void fillrange (char *mem, size_t size, const char *s, size_t len,
+                       size_t phase) {
+	size_t n = len - phase;
+	if (n > size) n = size;
+	memmove(mem, s + phase, n * sizeof(char));
+	mem += n;
+	size -= n;
+	while (size > 0) {
+		n = size < len ? size : len;
 		memmove(mem, s, n * sizeof(char));
 		mem += n;
 		size -= n;
-	} while (size > 0);
+	}
 }
 
-static int mem_resize (lua_State *L) {
-	size_t len;
-	luamem_Unref unref;
-	char *mem = luamem_tomemoryx(L, 1, &len, &unref, NULL);
-	size_t size = luamem_checklenarg(L, 2);
-	luaL_argcheck(L, unref == luamem_free, 1, "resizable memory expected");
-	if (len != size) {
-		size_t sl, n = len < size ? size-len : 0;
-		const char *s = luamem_optstring(L, 3, NULL, &sl);
-		char *resized = (char *)luamem_realloc(L, mem, len, size);
-		if (size && !resized) luaL_error(L, "out of memory");
-		luamem_setref(L, 1, mem, len, NULL);  /* don't free `mem` again */
-		luamem_setref(L, 1, resized, size, luamem_free);
-		if (n) {
-			resized += len;
-			if (sl) memfill(resized, n, s, sl);
-			else memset(resized, 0, n*sizeof(char));
+#define FILLBLOCK	(16*1024)  /* maximum size of copies of filled prefix */
+
+/*
+** Same as 'fillrange', but 's' must not overlap 'mem'. A single byte is
+** set by 'memset', and other patterns are copied once and then the filled
+** prefix of 'mem' is copied after itself, doubling its size until it has
+** 'FILLBLOCK' bytes or more, so the bulk of the work is done by large
+** copies from a prefix that stays in cache.
+*/
+static void fillpattern (char *mem, size_t size, const char *s, size_t len,
+                         size_t phase) {
+	if (len == 1) memset(mem, *s, size * sizeof(char));
+	else if (size > len) {
+		size_t done = len, prefix = len;
+		fillrange(mem, len, s, len, phase);
+		while (done < size) {
+			size_t n = size - done < prefix ? size - done : prefix;
+			memcpy(mem + done, mem, n * sizeof(char));
+			done += n;
+			if (prefix < FILLBLOCK) prefix = done;
 		}
 	}
-	return 0;
+	else fillrange(mem, size, s, len, phase);
 }
 
-static int mem_type (lua_State *L) {
-	luamem_Unref unref;
-	int type;
-	luamem_tomemoryx(L, 1, NULL, &unref, &type);
-	if (type == LUAMEM_TALLOC) {
-		lua_pushliteral(L, "fixed");
-	} else if (type == LUAMEM_TREF) {
-		if (unref == luamem_free) lua_pushliteral(L, "resizable");
-		else lua_pushliteral(L, "other");
-	} else {
-		lua_pushnil(L);
-	}
-	return 1;
+static void filltask (void *ud, size_t i, size_t n) {
+	RangeTask *t = (RangeTask *)ud;
+	size_t b = chunkpos(t->size, n, i), e = chunkpos(t->size, n, i+1);
+	if (e > b) fillpattern(t->mem + b, e - b, t->s, t->len, b % t->len);
 }
 
-static int mem_len (lua_State *L) {
+static void memfill (char *mem, size_t size, const char *s, size_t len) {
+	if (s + len <= mem || mem + size <= s) {  /* no overlap? */
+		RangeTask t;
+		t.mem = mem;
+		t.s = s;
+		t.size = size;
+		t.len = len;
+		parallel(filltask, &t, size);
+	}
+	else fillrange(mem, size, s, len, 0);
+}
+
+/*
+** Changes the size of the resizable memory at index 'idx' from 'len' to
+** 'size' bytes, and returns its new block address. Contents of the extra
+** bytes are undefined.
+*/
+static char *resizemem (lua_State *L, int idx, char *mem, size_t len,
+                                                          size_t size) {
+	char *resized;
+	if (luamem_pending(L, idx, 0))
+		luaL_error(L, "memory in use by pending operations");
+	resized = (char *)luamem_realloc(L, mem, len, size);
+	if (size && !resized) luaL_error(L, "out of memory");
+	luamem_setref(L, idx, mem, len, NULL);  /* don't free `mem` again */
+	luamem_setref(L, idx, resized, size, luamem_free);
+	return resized;
+}
+
+/*
+** Gets the contents of the string or memory at index 'arg' from the
+** position at 'arg+1' until the position at 'arg+2', following the same
+** rules of 'memory.tostring'.
+*/
+static const char *checkslice (lua_State *L, int arg, size_t *len) {
+	size_t l;
+	const char *s = luamem_checkstring(L, arg, &l);
+	lua_Integer posi = posrelat(luaL_optinteger(L, arg+1, 1), l);
+	lua_Integer pose = posrelat(luaL_optinteger(L, arg+2, -1), l);
+	if (posi < 1) posi = 1;
+	if (pose > (lua_Integer)l) pose = l;
+	if (posi > pose) {
+		*len = 0;
+		return s;
+	}
+	*len = (size_t)(pose - posi) + 1;
+	return s + posi - 1;
+}
+
+/*
+** Gets the memory at index 'arg' to be written from the position at
+** 'arg+1', which might be just after its end.
+*/
+static char *checkoutput (lua_State *L, int arg, size_t *len, size_t *pos) {
+	char *mem = luamem_checkmemory(L, arg, len);
+	lua_Integer i = posrelat(luaL_optinteger(L, arg+1, 1), *len);
+	luaL_argcheck(L, 1 <= i && i <= (lua_Integer)*len+1, arg+1,
+	                 "index out of bounds");
+	*pos = (size_t)i-1;
+	return mem;
+}
+
+/*
+** Changes memory at index 'arg' to have 'size' bytes if it is resizable,
+** otherwise raises an error.
+*/
+static char *growoutput (lua_State *L, int arg, char *mem, size_t *len,
+                                                           size_t size) {
+	luamem_Unref unref;
+	luamem_tomemoryx(L, arg, NULL, &unref, NULL);
+	luaL_argcheck(L, unref == luamem_free, arg, "memory too small");
+	mem = resizemem(L, arg, mem, *len, size);
+	*len = size;
+	return mem;
+}
+
+/*
+** Makes sure memory at index 'arg' has 'n' bytes from 'pos', enlarging it
+** if it is resizable.
+*/
+static char *checkroom (lua_State *L, int arg, char *mem, size_t *len,
+                        size_t pos, size_t n) {
+	if (n > *len - pos) {
+		luaL_argcheck(L, n <= LUAMEM_MAXALLOC - pos, arg, "memory too large");
+		mem = growoutput(L, arg, mem, len, pos + n);
+	}
+	return mem;
+}
+
+/*
+** Returns nil followed by the position of 'p' in the string or memory at
+** index 'arg', which is where invalid data was found.
+*/
+static int invaliddata (lua_State *L, int arg, const char *p) {
+	lua_pushnil(L);
+	lua_pushinteger(L, (lua_Integer)(p - luamem_tostring(L, arg, NULL)) + 1);
+	return 2;
+}
+
+static int mem_resize (lua_State *L) {
+	size_t len;
+	luamem_Unref unref;
+	char *mem = luamem_tomemoryx(L, 1, &len, &unref, NULL);
+	size_t size = luamem_checklenarg(L, 2);
+	luaL_argcheck(L, unref == luamem_free, 1, "resizable memory expected");
+	if (len != size) {
+		size_t sl, n = len < size ? size-len : 0;
+		const char *s = luamem_optstring(L, 3, NULL, &sl);
+		char *resized = resizemem(L, 1, mem, len, size);
+		if (n) {
+			resized += len;
+			if (sl) memfill(resized, n, s, sl);
+			else memsetpar(resized, 0, n);
+		}
+	}
+	return 0;
+}
+
+static int mem_type (lua_State *L) {
+	luamem_Unref unref;
+	int type;
+	luamem_tomemoryx(L, 1, NULL, &unref, &type);
+	if (type == LUAMEM_TALLOC || ismapped(unref)) {
+		lua_pushliteral(L, "fixed");
+	} else if (type == LUAMEM_TREF) {
+		if (unref == luamem_free) lua_pushliteral(L, "resizable");
+		else lua_pushliteral(L, "other");
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int mem_release (lua_State *L) {
+	luamem_Unref unref;
+	int type;
+	luamem_tomemoryx(L, 1, NULL, &unref, &type);
+	luaL_argcheck(L, type == LUAMEM_TREF, 1, "referenced memory expected");
+	/* keep resizable and fixed memories as such, others become empty */
+	if (unref != luamem_free && !ismapped(unref)) unref = NULL;
+	luamem_setref(L, 1, NULL, 0, unref);
+	return 0;
+}
+
+static int mem_pressure (lua_State *L) {
+	size_t threshold;
+	if (lua_isnoneornil(L, 1)) {
+		threshold = luamem_setpressure(L, 0);
+		luamem_setpressure(L, threshold);
+	}
+	else {
+		lua_Integer n = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, n >= 0, 1, "invalid threshold");
+		threshold = luamem_setpressure(L, (size_t)n);
+	}
+	lua_pushinteger(L, (lua_Integer)luamem_allocated(L));
+	lua_pushinteger(L, (lua_Integer)threshold);
+	return 2;
+}
+
+static int mem_alignment (lua_State *L) {
+	char *mem = luamem_checkmemory(L, 1, NULL);
+	size_t addr = (size_t)mem;
+	if (addr == 0) lua_pushnil(L);
+	else lua_pushinteger(L, (lua_Integer)(addr & (~addr + 1)));
+	return 1;
+}
+
+static int mem_snapshot (lua_State *L) {
+	size_t len;
+	luamem_Unref unref;
+	char *mem;
+	luamem_checkmemory(L, 1, NULL);
+	mem = luamem_tomemoryx(L, 1, &len, &unref, NULL);
+#ifdef LUAMEM_USE_MEMFD
+	if (unref == unmapfile && snapshotfile(L, 1, mem, len)) return 1;
+#endif
+	if (len < LUAMEM_MAPSIZE || (mem = newmapped(L, len)) == NULL)
+		mem = luamem_newalloc(L, len);
+	if (len > 0) memcpypar(mem, luamem_tostring(L, 1, NULL), len);
+	return 1;
+}
+
+static int mem_len (lua_State *L) {
 	size_t len;
 	luamem_checkmemory(L, 1, &len);
 	lua_pushinteger(L, (lua_Integer)len);
@@ -123,8 +1086,8 @@ static int mem_diff (lua_State *L) {
 	size_t l1, l2;
 	const char *s1 = luamem_checkstring(L, 1, &l1);
 	const char *s2 = luamem_checkstring(L, 2, &l2);
-	size_t i, n=(l1<l2 ? l1 : l2);
-	for (i=0; (i<n) && (s1[i]==s2[i]); ++i);
+	size_t n=(l1<l2 ? l1 : l2);
+	size_t i=memdiffpar(s1, s2, n);
 	if (i<n) {
 		lua_pushinteger(L, i+1);
 		lua_pushboolean(L, s1[i]<s2[i]);
@@ -155,6 +1118,86 @@ static int mem_set (lua_State *L) {
 	return 0;
 }
 
+static size_t checkwidth (lua_State *L, int arg) {
+	lua_Integer width = luaL_optinteger(L, arg, 1);
+	luaL_argcheck(L, width == 1 || width == 2 || width == 4, arg,
+	                 "invalid width");
+	return (size_t)width;
+}
+
+static int mem_totable (lua_State *L) {
+	size_t len, width = checkwidth(L, 4), n, k;
+	const unsigned char *s = (const unsigned char *)checkslice(L, 1, &len);
+	luaL_argcheck(L, len % width == 0, 3, "range is not a multiple of width");
+	n = len / width;
+	luaL_argcheck(L, n <= INT_MAX, 3, "too many elements");
+	if (lua_isnoneornil(L, 5)) lua_createtable(L, (int)n, 0);
+	else {
+		luaL_checktype(L, 5, LUA_TTABLE);
+		lua_settop(L, 5);
+	}
+	switch (width) {
+		case 1:
+			for (k = 0; k < n; k++) {
+				lua_pushinteger(L, s[k]);
+				lua_rawseti(L, -2, (lua_Integer)k + 1);
+			}
+			break;
+		case 2:
+			for (k = 0; k < n; k++) {
+				unsigned short v;
+				memcpy(&v, s + k*2, 2);
+				lua_pushinteger(L, v);
+				lua_rawseti(L, -2, (lua_Integer)k + 1);
+			}
+			break;
+		default:
+			for (k = 0; k < n; k++) {
+				unsigned int v;
+				memcpy(&v, s + k*4, 4);
+				lua_pushinteger(L, (lua_Integer)v);
+				lua_rawseti(L, -2, (lua_Integer)k + 1);
+			}
+			break;
+	}
+	lua_pushinteger(L, (lua_Integer)n);
+	return 2;
+}
+
+/* returns element 'k' of the table at index 3, which must fit in 'max' */
+static lua_Integer checkelement (lua_State *L, size_t k, lua_Unsigned max) {
+	int isint;
+	lua_Integer v;
+	lua_rawgeti(L, 3, (lua_Integer)k);
+	v = lua_tointegerx(L, -1, &isint);
+	if (!isint || (lua_Unsigned)v > max)
+		luaL_error(L, "invalid value (at index %d) in table", (int)k);
+	lua_pop(L, 1);
+	return v;
+}
+
+static int mem_fromtable (lua_State *L) {
+	size_t len, pos, width = checkwidth(L, 4), n, k;
+	char *p = checkoutput(L, 1, &len, &pos);
+	lua_Unsigned max = width == 4 ? 0xffffffffu : (1u << (width*8)) - 1;
+	luaL_checktype(L, 3, LUA_TTABLE);
+	n = (size_t)lua_rawlen(L, 3);
+	luaL_argcheck(L, n <= LUAMEM_MAXALLOC/width, 3, "too many elements");
+	for (k = 1; k <= n; k++)  /* validate all before changing the memory */
+		checkelement(L, k, max);
+	p = checkroom(L, 1, p, &len, pos, n*width) + pos;
+	for (k = 0; k < n; k++, p += width) {
+		lua_Integer v = checkelement(L, k + 1, max);
+		switch (width) {
+			case 1: *p = (char)v; break;
+			case 2: { unsigned short u = (unsigned short)v; memcpy(p, &u, 2); break; }
+			default: { unsigned int u = (unsigned int)v; memcpy(p, &u, 4); break; }
+		}
+	}
+	lua_pushinteger(L, (lua_Integer)(n*width));
+	return 1;
+}
+
 static int mem_find (lua_State *L) {
 	size_t len, sl;
 	const char *p = luamem_checkstring(L, 1, &len);
@@ -209,652 +1252,3999 @@ static int mem_fill (lua_State *L) {
 	return 0;
 }
 
-static int mem_pack (lua_State *L);
-static int mem_unpack (lua_State *L);
+static int mem_setthreads (lua_State *L) {
+#ifdef LUAMEM_USE_THREADS
+	int old = pool.nworkers+1;
+	size_t minsize = pool.minsize;
+	if (!lua_isnoneornil(L, 1)) {
+		lua_Integer n = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, 1 <= n && n <= MAXTHREADS, 1, "invalid number of threads");
+		if (setworkers((int)n-1) != (int)n-1)
+			return luaL_error(L, "unable to create threads");
+	}
+	if (!lua_isnoneornil(L, 2))
+		__atomic_store_n(&pool.minsize, luamem_checklenarg(L, 2), __ATOMIC_RELAXED);
+#else /* LUAMEM_USE_THREADS */
+	int old = 1;
+	size_t minsize = parminsize;
+	luaL_argcheck(L, luaL_optinteger(L, 1, 1) == 1, 1, "threads not supported");
+	if (!lua_isnoneornil(L, 2)) parminsize = luamem_checklenarg(L, 2);
+#endif /* LUAMEM_USE_THREADS */
+	lua_pushinteger(L, old);
+	lua_pushinteger(L, (lua_Integer)minsize);
+	return 2;
+}
 
-static const luaL_Reg lib[] = {
-	{"create", mem_create},
-	{"type", mem_type},
-	{"resize", mem_resize},
-	{"len", mem_len},
-	{"diff", mem_diff},
-	{"find", mem_find},
-	{"fill", mem_fill},
-	{"get", mem_get},
-	{"set", mem_set},
-	{"pack", mem_pack},
-	{"unpack", mem_unpack},
-	{"tostring", mem_tostring},
-	{NULL, NULL}
-};
+/*
+** {======================================================
+** RING BUFFERS
+** =======================================================
+*/
 
-static const luaL_Reg meta[] = {
-	{"__len", mem_len},
-	{"__tostring", mem_tostring},
-	{NULL, NULL}
-};
+#define LUAMEM_RING	"luamem_Ring"
 
+/* layout of the ring header inside the memory */
+#define RINGINFO	0
+#define RINGHEAD	(CACHELINE)
+#define RINGTAIL	(2*CACHELINE)
+#define RINGDATA	(3*CACHELINE)
 
-static void setupmetatable (lua_State *L) {
-	if (lua_getmetatable(L, -1)) {
-		luaL_setfuncs(L, meta, 0);  /* add metamethods to metatable */
-		lua_pushvalue(L, 1);  /* push library */
-		lua_setfield(L, -2, "__index");  /* metatable.__index = library */
-		lua_pop(L, 1);  /* pop metatable */
-	}
-	lua_pop(L, 1);  /* pop memory */
-}
+/* value of the first bytes of an initialized ring */
+#define RINGMAGIC	0x676e6952
 
+/* size of message headers, which also gives the alignment of messages */
+#define RECHDR	sizeof(size_t)
 
-LUAMEMMOD_API int luaopen_memory (lua_State *L) {
-	luaL_newlib(L, lib);
-	luamem_newalloc(L, 0);
-	setupmetatable(L);
-	luamem_newref(L);
-	setupmetatable(L);
-	return 1;
-}
+/* message header that indicates the data continues in the beginning */
+#define RECWRAP	(~(size_t)0)
 
-#ifdef _KERNEL
-MODULE_LICENSE("Dual MIT/BSD");
-MODULE_DESCRIPTION("Library for manipulation of memory areas in Lua");
+#define recalign(l)	(((l) + RECHDR - 1) & ~(RECHDR - 1))
 
-EXPORT_SYMBOL(luamem_addvalue);
-EXPORT_SYMBOL(luamem_checklenarg);
-EXPORT_SYMBOL(luamem_checkmemory);
-EXPORT_SYMBOL(luamem_checkstring);
-EXPORT_SYMBOL(luamem_free);
-EXPORT_SYMBOL(luamem_isstring);
-EXPORT_SYMBOL(luamem_newalloc);
-EXPORT_SYMBOL(luamem_newref);
-EXPORT_SYMBOL(luamem_pushresult);
-EXPORT_SYMBOL(luamem_pushresultsize);
-EXPORT_SYMBOL(luamem_realloc);
-EXPORT_SYMBOL(luamem_setref);
-EXPORT_SYMBOL(luamem_tomemoryx);
-EXPORT_SYMBOL(luamem_tostring);
-EXPORT_SYMBOL(luamem_type);
-EXPORT_SYMBOL(luaopen_memory);
+#ifndef _KERNEL
+#define ringload(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ringstore(p,v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else /* _KERNEL */
+#define ringload(p)	smp_load_acquire(p)
+#define ringstore(p,v)	smp_store_release((p), (v))
+#endif /* _KERNEL */
 
-static int __init modinit (void) {
-	return 0;
-}
+typedef struct RingInfo {
+	unsigned int magic;
+	size_t size;  /* number of bytes available for messages */
+} RingInfo;
 
-static void __exit modexit (void) {
+typedef struct Ring {
+	size_t *head;  /* offset of the next message to be consumed */
+	size_t *tail;  /* offset of the next message to be produced */
+	char *data;
+	size_t size;
+} Ring;
+
+static void initring (char *mem, size_t len) {
+	RingInfo *info = (RingInfo *)(mem + RINGINFO);
+	size_t size = (len - RINGDATA) & ~(RECHDR - 1);
+	if (info->magic != RINGMAGIC || info->size != size) {
+		*((size_t *)(mem + RINGHEAD)) = 0;
+		*((size_t *)(mem + RINGTAIL)) = 0;
+		info->size = size;
+		ringstore(&info->magic, RINGMAGIC);
+	}
 }
 
-module_init(modinit);
-module_exit(modexit);
-#endif /* _KERNEL */
+static void checkring (lua_State *L, Ring *r) {
+	size_t len;
+	char *mem;
+	luaL_checkudata(L, 1, LUAMEM_RING);
+	lua_getuservalue(L, 1);
+	mem = luamem_tomemory(L, -1, &len);
+	lua_pop(L, 1);  /* memory is kept by the ring */
+	r->size = ((RingInfo *)(mem + RINGINFO))->size;
+	if (len < RINGDATA || len - RINGDATA < r->size)
+		luaL_error(L, "ring memory was resized");
+	r->head = (size_t *)(mem + RINGHEAD);
+	r->tail = (size_t *)(mem + RINGTAIL);
+	r->data = mem + RINGDATA;
+}
 
 /*
-* NOTE: most of the code below is copied from the source of Lua 5.3.1 by
-*       R. Ierusalimschy, L. H. de Figueiredo, W. Celes - Lua.org, PUC-Rio.
-*
-* Copyright (C) 1994-2015 Lua.org, PUC-Rio.
-*
-* Permission is hereby granted, free of charge, to any person obtaining
-* a copy of this software and associated documentation files (the
-* "Software"), to deal in the Software without restriction, including
-* without limitation the rights to use, copy, modify, merge, publish,
-* distribute, sublicense, and/or sell copies of the Software, and to
-* permit persons to whom the Software is furnished to do so, subject to
-* the following conditions:
-*
-* The above copyright notice and this permission notice shall be
-* included in all copies or substantial portions of the Software.
-*
-* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
-* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
-* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
-* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
-* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
-* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
-* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+** Messages must fit in half of the ring, so they can always be written
+** when the ring is empty, whatever the current offsets are.
 */
+#define fitsring(r,l)	(RECHDR + recalign(l) <= ((r)->size - RECHDR)/2)
 
+/*
+** Writes message 's' of 'l' bytes at offset '*tail', which is updated to
+** the offset following the message. Returns 0 if there is not enough
+** free space given that offset 'head' is still being consumed.
+** One header of space is always kept free to tell a full ring from an
+** empty one.
+*/
+static int ringput (Ring *r, size_t head, size_t *tail,
+                    const char *s, size_t l) {
+	size_t t = *tail;
+	size_t used = (t >= head) ? t - head : r->size - head + t;
+	size_t avail = r->size - used - RECHDR;
+	size_t need = RECHDR + recalign(l);
+	size_t contig = r->size - t;
+	if (need > contig) {  /* must continue from the beginning? */
+		if (contig + need > avail) return 0;
+		*((size_t *)(r->data + t)) = RECWRAP;
+		t = 0;
+	}
+	else if (need > avail) return 0;
+	*((size_t *)(r->data + t)) = l;
+	memcpy(r->data + t + RECHDR, s, l * sizeof(char));
+	t += need;
+	*tail = (t == r->size) ? 0 : t;
+	return 1;
+}
 
+/*
+** Returns the message at offset '*head', which is updated to the offset
+** following the message, or NULL if offset '*head' reached 'tail'.
+*/
+static const char *ringget (lua_State *L, Ring *r, size_t *head,
+                            size_t tail, size_t *l) {
+	size_t h = *head;
+	if (h == tail) return NULL;
+	*l = *((size_t *)(r->data + h));
+	if (*l == RECWRAP) {
+		h = 0;
+		*l = *((size_t *)r->data);
+	}
+	if (*l > r->size - RECHDR - h)
+		luaL_error(L, "corrupted ring");
+	*head = h + RECHDR + recalign(*l);
+	if (*head == r->size) *head = 0;
+	return r->data + h + RECHDR;
+}
 
-/* macro to 'unsign' a character */
-#define uchar(c)	((unsigned char)(c))
-
-
-/* translate a relative string position: negative means back from end */
-static lua_Integer posrelat (lua_Integer pos, size_t len) {
-	if (pos >= 0) return pos;
-	else if (0u - (size_t)pos > len) return 0;
-	else return (lua_Integer)len + pos + 1;
+static int mem_ring (lua_State *L) {
+	size_t len;
+	char *mem;
+	if (lua_type(L, 1) == LUA_TNUMBER) {
+		size_t size = luamem_checklenarg(L, 1);
+		luaL_argcheck(L, size <= LUAMEM_MAXALLOC - RINGDATA - RECHDR, 1,
+		                 "invalid size");
+		len = RINGDATA + recalign(size);
+		mem = luamem_newalloc(L, len);
+		memset(mem, 0, len * sizeof(char));
+	}
+	else {
+		mem = luamem_checkmemory(L, 1, &len);
+		lua_pushvalue(L, 1);
+	}
+	luaL_argcheck(L, ((size_t)mem & (sizeof(size_t) - 1)) == 0, 1,
+	                 "misaligned memory");
+	luaL_argcheck(L, len >= RINGDATA + 2*RECHDR, 1, "memory too small");
+	markconcurrent(L, -1, 1);  /* the other side of the ring writes it */
+	initring(mem, len);
+	lua_newuserdata(L, 0);
+	luaL_setmetatable(L, LUAMEM_RING);
+	lua_insert(L, -2);
+	lua_setuservalue(L, -2);
+	return 1;
 }
 
-static int str2byte (lua_State *L, const char *s, size_t l) {
-	lua_Integer posi = posrelat(luaL_optinteger(L, 2, 1), l);
-	lua_Integer pose = posrelat(luaL_optinteger(L, 3, posi), l);
-	int n, i;
-	if (posi < 1) posi = 1;
-	if (pose > (lua_Integer)l) pose = l;
-	if (posi > pose) return 0;  /* empty interval; return no values */
-	n = (int)(pose - posi + 1);
-	if (posi + n <= pose)  /* arithmetic overflow? */
-		return luaL_error(L, "string slice too long");
-	luaL_checkstack(L, n, "string slice too long");
-	for (i=0; i<n; i++)
-		lua_pushinteger(L, uchar(s[posi+i-1]));
-	return n;
+static int ring_push (lua_State *L) {
+	Ring r;
+	size_t l, tail;
+	const char *s;
+	checkring(L, &r);
+	s = checkslice(L, 2, &l);
+	luaL_argcheck(L, fitsring(&r, l), 2, "message too large");
+	tail = *r.tail;  /* only the producer updates it */
+	if (ringput(&r, ringload(r.head), &tail, s, l)) {
+		ringstore(r.tail, tail);
+		lua_pushboolean(L, 1);
+	}
+	else lua_pushboolean(L, 0);
+	return 1;
 }
 
-static void code2char (lua_State *L, int idx, char *p, lua_Integer n) {
-	int i;
-	for (i=0; i<n; ++i, ++idx) {
-		lua_Integer c = luaL_checkinteger(L, idx);
-		luaL_argcheck(L, uchar(c) == c, idx, "value out of range");
-		p[i] = uchar(c);
+static int ring_pushbatch (lua_State *L) {
+	Ring r;
+	size_t head, tail;
+	lua_Integer i, n;
+	checkring(L, &r);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = luaL_len(L, 2);
+	head = ringload(r.head);
+	tail = *r.tail;
+	for (i = 0; i < n; i++) {
+		size_t l;
+		const char *s;
+		lua_rawgeti(L, 2, i+1);
+		s = luamem_tostring(L, -1, &l);
+		if (!luamem_isstring(L, -1) || !fitsring(&r, l))
+			luaL_error(L, "invalid value (at index %d) in table for 'pushbatch'",
+			              (int)(i+1));
+		if (!ringput(&r, head, &tail, s, l)) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_pop(L, 1);
 	}
+	ringstore(r.tail, tail);
+	lua_pushinteger(L, i);
+	return 1;
 }
 
-static const char *lmemfind (const char *s1, size_t l1,
-                             const char *s2, size_t l2) {
-	if (l2 == 0) return s1;  /* empty strings are everywhere */
-	else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+static int ring_pop (lua_State *L) {
+	Ring r;
+	size_t l, head;
+	const char *s;
+	checkring(L, &r);
+	head = *r.head;  /* only the consumer updates it */
+	s = ringget(L, &r, &head, ringload(r.tail), &l);
+	if (!s) return 0;
+	if (lua_isnoneornil(L, 2)) lua_pushlstring(L, s, l);
 	else {
-		const char *init;  /* to search for a '*s2' inside 's1' */
-		l2--;  /* 1st char will be checked by 'memchr' */
-		l1 = l1-l2;  /* 's2' cannot be found after that */
-		while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-			init++;   /* 1st char is already checked */
-			if (memcmp(init, s2+1, l2) == 0)
-				return init-1;
-			else {  /* correct 'l1' and 's1' to try again */
-				l1 -= init-s1;
-				s1 = init;
-			}
-		}
-		return NULL;  /* not found */
+		size_t len, i;
+		char *mem = checkoutput(L, 2, &len, &i);
+		if (l > len-i) mem = growoutput(L, 2, mem, &len, i+l);
+		memcpy(mem+i, s, l * sizeof(char));
+		lua_pushinteger(L, (lua_Integer)l);
 	}
+	ringstore(r.head, head);
+	return 1;
 }
 
-/*
-** {======================================================
-** PACK/UNPACK
-** =======================================================
-*/
+static int ring_popbatch (lua_State *L) {
+	Ring r;
+	size_t head, tail;
+	lua_Integer i, n;
+	checkring(L, &r);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+	head = *r.head;
+	tail = ringload(r.tail);
+	for (i = 0; i < n; i++) {
+		size_t l;
+		const char *s = ringget(L, &r, &head, tail, &l);
+		if (!s) break;
+		lua_pushlstring(L, s, l);
+		lua_rawseti(L, 2, i+1);
+	}
+	ringstore(r.head, head);
+	lua_pushinteger(L, i);
+	return 1;
+}
 
-/* value used for padding */
-#if !defined(LUA_PACKPADBYTE)
-#define LUA_PACKPADBYTE		0x00
-#endif
+static int ring_peek (lua_State *L) {
+	Ring r;
+	size_t l, head;
+	const char *s;
+	checkring(L, &r);
+	head = *r.head;
+	s = ringget(L, &r, &head, ringload(r.tail), &l);
+	if (!s) return 0;
+	luamem_newref(L);
+	luamem_setref(L, -1, (char *)s, l, NULL);
+	lua_getuservalue(L, 1);
+	lua_setuservalue(L, -2);  /* view keeps the ring memory alive */
+	return 1;
+}
 
-/* maximum size for the binary representation of an integer */
-#define MAXINTSIZE	16
+static int ring_memory (lua_State *L) {
+	luaL_checkudata(L, 1, LUAMEM_RING);
+	lua_getuservalue(L, 1);
+	return 1;
+}
 
-/* number of bits in a character */
-#define NB	CHAR_BIT
+static const luaL_Reg ringmeth[] = {
+	{"push", ring_push},
+	{"pushbatch", ring_pushbatch},
+	{"pop", ring_pop},
+	{"popbatch", ring_popbatch},
+	{"peek", ring_peek},
+	{"memory", ring_memory},
+	{NULL, NULL}
+};
 
-/* mask for one character (NB 1's) */
-#define MC	((1 << NB) - 1)
+static void createringmeta (lua_State *L) {
+	luaL_newmetatable(L, LUAMEM_RING);
+	luaL_newlib(L, ringmeth);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);  /* pop metatable */
+}
 
-/* size of a lua_Integer */
-#define SZINT	((int)sizeof(lua_Integer))
+/* }====================================================== */
 
 
-/* dummy union to get native endianness */
-static const union {
-	int dummy;
-	char little;  /* true iff machine is little endian */
-} nativeendian = {1};
+/*
+** {======================================================
+** INDEXES
+** =======================================================
+*/
 
+/*
+** Hash tables with open addressing (linear probing) whose keys are byte
+** sequences copied to an arena. Integer values are stored in the entries,
+** other values are referenced in the table that is the uservalue of the
+** index.
+*/
 
-/* dummy structure to get native alignment requirements */
-struct cD {
-	char c;
-#ifndef _KERNEL
-	union { double d; void *p; lua_Integer i; lua_Number n; } u;
-#else /* _KERNEL */
-	union { void *p; lua_Integer i; lua_Number n; } u;
-#endif /* _KERNEL */
-};
+#define LUAMEM_INDEX	"luamem_Index"
 
-#define MAXALIGN	(offsetof(struct cD, u))
+#define IEMPTY	0  /* never used entry */
+#define IDEAD	1  /* removed entry */
+#define IINT	2  /* entry with integer value */
+#define IREF	3  /* entry with value referenced in the uservalue table */
 
+#define IMINSIZE	8  /* minimum number of entries */
 
-#ifndef _KERNEL
-/*
-** Union for serializing floats
-*/
-typedef union Ftypes {
-	float f;
-	double d;
-	lua_Number n;
-	char buff[5 * sizeof(lua_Number)];  /* enough for any float type */
-} Ftypes;
-#endif /* _KERNEL */
+typedef struct IndexEntry {
+	size_t hash;
+	size_t key;  /* offset of the key in the arena */
+	size_t len;  /* length of the key */
+	lua_Integer value;  /* integer value or reference */
+	int kind;
+} IndexEntry;
 
+typedef struct Index {
+	IndexEntry *entries;
+	size_t size;  /* number of entries (a power of 2) */
+	size_t count;  /* entries with values */
+	size_t used;  /* entries with values or removed */
+	char *keys;  /* arena of keys */
+	size_t keyslen;  /* bytes used in the arena */
+	size_t keyssize;  /* bytes allocated for the arena */
+	size_t garbage;  /* bytes of keys removed from the arena */
+	size_t seed;
+} Index;
 
-/*
-** information to pack/unpack stuff
-*/
-typedef struct Header {
-	lua_State *L;
-	int islittle;
-	int maxalign;
-} Header;
+#define HASHMUL1	((size_t)0x9e3779b97f4a7c15ULL)
+#define HASHMUL2	((size_t)0xbf58476d1ce4e5b9ULL)
 
+static size_t hashmix (size_t h, size_t k) {
+	h ^= k * HASHMUL1;
+	h ^= h >> (sizeof(size_t) * 4 - 3);
+	return h * HASHMUL2;
+}
 
 /*
-** options for pack/unpack
+** Hash of a key taken a word at a time, with the remaining bytes packed
+** in a final word.
 */
-typedef enum KOption {
-	Kint,		/* signed integers */
-	Kuint,	/* unsigned integers */
-#ifndef _KERNEL
-	Kfloat,	/* floating-point numbers */
-#endif /* _KERNEL */
-	Kchar,	/* fixed-length strings */
-	Kstring,	/* strings with prefixed length */
-	Kzstr,	/* zero-terminated strings */
-	Kpadding,	/* padding */
-	Kpaddalign,	/* padding for alignment */
-	Knop		/* no-op (configuration or spaces) */
-} KOption;
+static size_t hashkey (const char *s, size_t len, size_t seed) {
+	size_t h = seed ^ len, w, i;
+	for (i = 0; len - i >= sizeof(size_t); i += sizeof(size_t)) {
+		memcpy(&w, s + i, sizeof(size_t));
+		h = hashmix(h, w);
+	}
+	if (i < len) {
+		w = 0;
+		memcpy(&w, s + i, len - i);
+		h = hashmix(h, w);
+	}
+	return h ^ (h >> (sizeof(size_t) * 4));
+}
 
+static Index *checkindex (lua_State *L) {
+	return (Index *)luaL_checkudata(L, 1, LUAMEM_INDEX);
+}
 
 /*
-** Read an integer numeral from string 'fmt' or return 'df' if
-** there is no numeral
+** Returns the entry with key 's' of 'len' bytes with hash 'h', or the free
+** entry where it should be placed (a removed one, if any) if 'insert' is
+** true, or NULL otherwise.
 */
-static int digit (int c) { return '0' <= c && c <= '9'; }
-
-static int getnum (const char **fmt, int df) {
-	if (!digit(**fmt))  /* no number? */
-		return df;  /* return default value */
-	else {
-		int a = 0;
-		do {
-			a = a*10 + (*((*fmt)++) - '0');
-		} while (digit(**fmt) && a <= ((int)LUAMEM_MAXALLOC - 9)/10);
-		return a;
+static IndexEntry *findentry (Index *x, const char *s, size_t len, size_t h,
+                              int insert) {
+	size_t mask = x->size - 1, i = h & mask;
+	IndexEntry *dead = NULL;
+	if (x->size == 0) return NULL;
+	for (;; i = (i + 1) & mask) {
+		IndexEntry *e = &x->entries[i];
+		if (e->kind == IEMPTY)
+			return insert ? (dead ? dead : e) : NULL;
+		if (e->kind == IDEAD) {
+			if (dead == NULL) dead = e;
+		}
+		else if (e->hash == h && e->len == len &&
+		         memcmp(x->keys + e->key, s, len) == 0)
+			return e;
 	}
 }
 
-
 /*
-** Read an integer numeral and raises an error if it is larger
-** than the maximum size for integers.
+** Rebuilds the entries with 'size' entries and an arena with only the keys
+** in use plus 'extra' bytes.
 */
-static int getnumlimit (Header *h, const char **fmt, int df) {
-	int sz = getnum(fmt, df);
-	if (sz > MAXINTSIZE || sz <= 0)
-		luaL_error(h->L, "integral size (%d) out of limits [1,%d]",
-		                 sz, MAXINTSIZE);
-	return sz;
+static void rehashindex (lua_State *L, Index *x, size_t size, size_t extra) {
+	size_t i, keyssize = x->keyslen - x->garbage + extra;
+	IndexEntry *entries = (IndexEntry *)luamem_realloc(L, NULL, 0,
+	                                                   size * sizeof(IndexEntry));
+	char *keys = keyssize ? (char *)luamem_realloc(L, NULL, 0, keyssize) : NULL;
+	size_t keyslen = 0;
+	if (entries == NULL || (keyssize && keys == NULL)) {
+		if (entries) luamem_free(L, entries, size * sizeof(IndexEntry));
+		luaL_error(L, "out of memory");
+	}
+	memset(entries, 0, size * sizeof(IndexEntry));
+	for (i = 0; i < x->size; i++) {
+		IndexEntry *e = &x->entries[i];
+		if (e->kind >= IINT) {
+			size_t j = e->hash & (size - 1);
+			while (entries[j].kind != IEMPTY) j = (j + 1) & (size - 1);
+			entries[j] = *e;
+			if (e->len) memcpy(keys + keyslen, x->keys + e->key, e->len);
+			entries[j].key = keyslen;
+			keyslen += e->len;
+		}
+	}
+	if (x->entries) luamem_free(L, x->entries, x->size * sizeof(IndexEntry));
+	if (x->keys) luamem_free(L, x->keys, x->keyssize);
+	x->entries = entries;
+	x->size = size;
+	x->used = x->count;
+	x->keys = keys;
+	x->keyslen = keyslen;
+	x->keyssize = keyssize;
+	x->garbage = 0;
 }
 
-
 /*
-** Initialize Header
+** Makes sure there is a free entry and 'len' bytes in the arena for a new
+** key.
 */
-static void initheader (lua_State *L, Header *h) {
-	h->L = L;
-	h->islittle = nativeendian.little;
-	h->maxalign = 1;
+static void reserveindex (lua_State *L, Index *x, size_t len) {
+	if (x->used + 1 > x->size / 2) {  /* keep load factor below 1/2 */
+		size_t size = x->size ? x->size : IMINSIZE;
+		while (x->count + 1 > size / 2) size *= 2;
+		luaL_argcheck(L, size <= LUAMEM_MAXALLOC / sizeof(IndexEntry), 1,
+		                 "too many keys");
+		rehashindex(L, x, size, len);
+	}
+	if (len > x->keyssize - x->keyslen) {
+		size_t size;
+		luaL_argcheck(L, len <= LUAMEM_MAXALLOC - x->keyslen, 2, "keys too large");
+		if (x->garbage > x->keyslen / 2) {  /* mostly garbage? */
+			rehashindex(L, x, x->size, len);
+			if (len <= x->keyssize - x->keyslen) return;
+		}
+		size = x->keyssize < LUAMEM_MAXALLOC/2 ? x->keyssize * 2 : LUAMEM_MAXALLOC;
+		if (size < x->keyslen + len) size = x->keyslen + len;
+		x->keys = (char *)luamem_realloc(L, x->keys, x->keyssize, size);
+		if (x->keys == NULL) {
+			x->keyssize = 0;
+			luaL_error(L, "out of memory");
+		}
+		x->keyssize = size;
+	}
 }
 
-
-/*
-** Read and classify next option. 'size' is filled with option's size.
-*/
-static KOption getoption (Header *h, const char **fmt, int *size) {
-	int opt = *((*fmt)++);
-	*size = 0;  /* default */
-	switch (opt) {
-		case 'b': *size = sizeof(char); return Kint;
-		case 'B': *size = sizeof(char); return Kuint;
-		case 'h': *size = sizeof(short); return Kint;
-		case 'H': *size = sizeof(short); return Kuint;
-		case 'l': *size = sizeof(long); return Kint;
-		case 'L': *size = sizeof(long); return Kuint;
-		case 'j': *size = sizeof(lua_Integer); return Kint;
-		case 'J': *size = sizeof(lua_Integer); return Kuint;
-		case 'T': *size = sizeof(size_t); return Kuint;
-#ifndef _KERNEL
-		case 'f': *size = sizeof(float); return Kfloat;
-		case 'd': *size = sizeof(double); return Kfloat;
-		case 'n': *size = sizeof(lua_Number); return Kfloat;
-#else /* _KERNEL */
-		case 'n': *size = sizeof(lua_Number); return Kint;
-#endif /* _KERNEL */
-		case 'i': *size = getnumlimit(h, fmt, sizeof(int)); return Kint;
-		case 'I': *size = getnumlimit(h, fmt, sizeof(int)); return Kuint;
-		case 's': *size = getnumlimit(h, fmt, sizeof(size_t)); return Kstring;
-		case 'c':
-			*size = getnum(fmt, -1);
-			if (*size == -1)
-				luaL_error(h->L, "missing size for format option 'c'");
-			return Kchar;
-		case 'z': return Kzstr;
-		case 'x': *size = 1; return Kpadding;
-		case 'X': return Kpaddalign;
-		case ' ': break;
-		case '<': h->islittle = 1; break;
-		case '>': h->islittle = 0; break;
-		case '=': h->islittle = nativeendian.little; break;
-		case '!': h->maxalign = getnumlimit(h, fmt, MAXALIGN); break;
-		default: luaL_error(h->L, "invalid format option '%c'", opt);
+static void removevalue (lua_State *L, IndexEntry *e) {
+	if (e->kind == IREF) {
+		lua_getuservalue(L, 1);
+		luaL_unref(L, -1, (int)e->value);
+		lua_pop(L, 1);
 	}
-	return Knop;
 }
 
+static int index_get (lua_State *L) {
+	Index *x = checkindex(L);
+	size_t len;
+	const char *s = checkslice(L, 2, &len);
+	IndexEntry *e = findentry(x, s, len, hashkey(s, len, x->seed), 0);
+	if (e == NULL) lua_pushnil(L);
+	else if (e->kind == IINT) lua_pushinteger(L, e->value);
+	else {
+		lua_getuservalue(L, 1);
+		lua_rawgeti(L, -1, e->value);
+	}
+	return 1;
+}
 
-/*
-** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
-** Local variable 'size' gets the size to be aligned. (Kpadal option
-** always gets its full alignment, other options are limited by 
-** the maximum alignment ('maxalign'). Kchar option needs no alignment
-** despite its size.
-*/
-static KOption getdetails (Header *h, size_t totalsize,
-                           const char **fmt, int *psize, int *ntoalign) {
-	KOption opt = getoption(h, fmt, psize);
-	int align = *psize;  /* usually, alignment follows size */
-	if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
-		if (**fmt == '\0' || getoption(h, fmt, &align) == Kchar || align == 0)
-			luaL_argerror(h->L, 1, "invalid next option for option 'X'");
+static int index_set (lua_State *L) {
+	Index *x = checkindex(L);
+	size_t len, h;
+	const char *s;
+	IndexEntry *e;
+	luaL_checkany(L, 2);
+	s = checkslice(L, 3, &len);
+	h = hashkey(s, len, x->seed);
+	e = findentry(x, s, len, h, 0);
+	if (lua_isnil(L, 2)) {  /* remove? */
+		if (e) {
+			removevalue(L, e);
+			e->kind = IDEAD;
+			x->count--;
+			x->garbage += e->len;
+		}
+		return 0;
+	}
+	if (e == NULL) {  /* new key? */
+		reserveindex(L, x, len);
+		e = findentry(x, s, len, h, 1);
+		if (e->kind == IEMPTY) x->used++;
+		x->count++;
+		e->hash = h;
+		e->key = x->keyslen;
+		e->len = len;
+		if (len) memcpy(x->keys + x->keyslen, s, len);
+		x->keyslen += len;
+	}
+	else removevalue(L, e);
+	if (lua_isinteger(L, 2)) {
+		e->kind = IINT;
+		e->value = lua_tointeger(L, 2);
 	}
-	if (align <= 1 || opt == Kchar)  /* need no alignment? */
-		*ntoalign = 0;
 	else {
-		if (align > h->maxalign)  /* enforce maximum alignment */
-			align = h->maxalign;
-		if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
-			luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
-		*ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
+		e->kind = IDEAD;  /* in case 'luaL_ref' fails */
+		lua_getuservalue(L, 1);
+		lua_pushvalue(L, 2);
+		e->value = luaL_ref(L, -2);
+		e->kind = IREF;
 	}
-	return opt;
+	return 0;
 }
 
-
-static char *getbytes (char **b, size_t *i, size_t lb, size_t sz) {
-	size_t newtotal = *i+sz;
-	if (newtotal<=lb) {
-		char *res = *b;
-		*b += sz;
-		*i = newtotal;
-		return res;
-	}
-	return NULL;
+static int index_clear (lua_State *L) {
+	Index *x = checkindex(L);
+	size_t seed = x->seed;  /* keep hashes of this index unpredictable */
+	if (x->entries) luamem_free(L, x->entries, x->size * sizeof(IndexEntry));
+	if (x->keys) luamem_free(L, x->keys, x->keyssize);
+	memset(x, 0, sizeof(Index));
+	x->seed = seed;
+	lua_newtable(L);
+	lua_setuservalue(L, 1);
+	return 0;
 }
 
-static int packfailed (lua_State *L, size_t i, size_t arg) {
-	lua_pushboolean(L, 0);
-	lua_replace(L, arg-2);
-	lua_pushinteger(L, i+1);
-	lua_replace(L, arg-1);
-	return 3+lua_gettop(L)-arg;
+static int index_len (lua_State *L) {
+	lua_pushinteger(L, (lua_Integer)checkindex(L)->count);
+	return 1;
 }
 
-static int packchar (char **b, size_t *i, size_t lb, const char c) {
-	if (*i<lb) {
-		(void)(*i)++;
-		*((*b)++) = c;
-		return 1;
-	}
+static int index_gc (lua_State *L) {
+	Index *x = (Index *)lua_touserdata(L, 1);
+	if (x->entries) luamem_free(L, x->entries, x->size * sizeof(IndexEntry));
+	if (x->keys) luamem_free(L, x->keys, x->keyssize);
+	x->entries = NULL;
+	x->keys = NULL;
 	return 0;
 }
 
-static int packstream (char **b, size_t *i, size_t lb,
-                       const char *s, size_t sl) {
-	if (sl > 0) {  /* avoid 'memcpy' when 's' can be NULL */
-		char *d = getbytes(b, i, lb, sl);
-		if (d == NULL) return 0;
-		memcpy(d, s, sl * sizeof(char));
-	}
+static int mem_index (lua_State *L) {
+	Index *x = (Index *)lua_newuserdata(L, sizeof(Index));
+	memset(x, 0, sizeof(Index));
+	x->seed = hashmix((size_t)x, (size_t)L);
+	luaL_setmetatable(L, LUAMEM_INDEX);
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
 	return 1;
 }
 
+static const luaL_Reg indexmeth[] = {
+	{"get", index_get},
+	{"set", index_set},
+	{"clear", index_clear},
+	{NULL, NULL}
+};
+
+static void createindexmeta (lua_State *L) {
+	luaL_newmetatable(L, LUAMEM_INDEX);
+	luaL_newlib(L, indexmeth);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, index_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, index_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+/* }====================================================== */
+
 
+#ifdef LUAMEM_USE_AIO
 /*
-** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
-** The final 'if' handles the case when 'size' is larger than
-** the size of a Lua integer, correcting the extra sign-extension
+** {======================================================
+** ASYNCHRONOUS I/O
+** =======================================================
+*/
+
+/*
+** Operations are queued by the Lua state, and submitted in batches either
+** to an io_uring instance, or to a pool of threads that perform them with
+** blocking system calls when io_uring is not available. The strings and
+** memories of operations not yet reaped are kept in the uservalue table
+** of the context, indexed by the operation identifier, and the context
+** is referenced in the registry while it has operations, so they are not
+** collected while the operations are performed.
+*/
+
+#define LUAMEM_AIO	"luamem_AIO"
+
+#if !defined(LUAMEM_AIOSIZE)
+#define LUAMEM_AIOSIZE	256  /* default maximum number of operations */
+#endif
+
+#if !defined(LUAMEM_AIOTHREADS)
+#define LUAMEM_AIOTHREADS	4  /* threads of the pool fallback */
+#endif
+
+#define AIOMAXSIZE	32768  /* maximum entries of an io_uring */
+#define AIOMAXLEN	((size_t)0x7ffff000)  /* maximum bytes of a system call */
+
+typedef struct AioOp {
+	struct AioOp *next;  /* in list of free, queued, or completed operations */
+	lua_Integer id;
+	int fd;
+	int write;
+	char *buf;
+	size_t len;
+	long long off;  /* or -1 for the current file position */
+	long long res;  /* bytes transferred or negated 'errno' */
+} AioOp;
+
+typedef struct AioContext {
+	size_t size;  /* number of operations */
+	size_t queued;  /* operations not submitted yet */
+	size_t inflight;  /* operations submitted and not reaped */
+	lua_Integer lastid;
+	int anchor;  /* reference of the context while it has operations */
+	int closed;
+	AioOp *ops;
+	AioOp *free;
+	AioOp *first, **last;  /* queue of operations not submitted */
+#ifdef LUAMEM_USE_IOURING
+	int ring;  /* io_uring file descriptor, or -1 */
+	void *sqmap, *cqmap;
+	size_t sqmapsize, cqmapsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+#endif /* LUAMEM_USE_IOURING */
+	int nthreads;  /* threads started for the pool */
+	int stop;  /* threads must exit */
+	pthread_mutex_t lock;
+	pthread_cond_t work;  /* signals submitted operations */
+	pthread_cond_t done;  /* signals completed operations */
+	AioOp *pending, **lastpending;  /* submitted to the pool */
+	AioOp *completed;  /* completed by the pool */
+	size_t ncompleted;
+	pthread_t threads[LUAMEM_AIOTHREADS];
+} AioContext;
+
+static AioContext *checkaio (lua_State *L) {
+	AioContext *c = (AioContext *)luaL_checkudata(L, 1, LUAMEM_AIO);
+	if (c->closed) luaL_error(L, "attempt to use a closed context");
+	return c;
+}
+
+static void performop (AioOp *op) {
+	ssize_t res;
+	if (op->off < 0) res = op->write ? write(op->fd, op->buf, op->len)
+	                                 : read(op->fd, op->buf, op->len);
+	else res = op->write ? pwrite(op->fd, op->buf, op->len, (off_t)op->off)
+	                     : pread(op->fd, op->buf, op->len, (off_t)op->off);
+	op->res = res < 0 ? -(long long)errno : (long long)res;
+}
+
+static void *aioworker (void *ud) {
+	AioContext *c = (AioContext *)ud;
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		AioOp *op;
+		while (c->pending == NULL && !c->stop)
+			pthread_cond_wait(&c->work, &c->lock);
+		if (c->pending == NULL) break;  /* stopped */
+		op = c->pending;
+		c->pending = op->next;
+		if (c->pending == NULL) c->lastpending = &c->pending;
+		pthread_mutex_unlock(&c->lock);
+		performop(op);
+		pthread_mutex_lock(&c->lock);
+		op->next = c->completed;
+		c->completed = op;
+		c->ncompleted++;
+		pthread_cond_signal(&c->done);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+#ifdef LUAMEM_USE_IOURING
+
+/*
+** Sets up the io_uring of the context, returning 0, or an error code if
+** it is not available. It requires reads and writes at the current file
+** position (Linux 5.6), which also implies the operations used here.
+*/
+static int setupring (AioContext *c) {
+	struct io_uring_params p;
+	int ring, err;
+	memset(&p, 0, sizeof(p));
+	ring = (int)syscall(SYS_io_uring_setup, (unsigned)c->size, &p);
+	if (ring < 0) return errno;
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring);
+		return EOPNOTSUPP;
+	}
+	c->sqmapsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	c->cqmapsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (c->cqmapsize > c->sqmapsize) c->sqmapsize = c->cqmapsize;
+		c->cqmapsize = 0;
+	}
+	c->sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+	c->sqmap = mmap(NULL, c->sqmapsize, PROT_READ|PROT_WRITE,
+	                MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	c->cqmap = c->cqmapsize == 0 ? c->sqmap :
+	           mmap(NULL, c->cqmapsize, PROT_READ|PROT_WRITE,
+	                MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	c->sqes = (struct io_uring_sqe *)mmap(NULL, c->sqessize,
+	          PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (c->sqmap == MAP_FAILED || c->cqmap == MAP_FAILED ||
+	    c->sqes == (struct io_uring_sqe *)MAP_FAILED) {
+		err = errno;  /* before it is changed by the cleanup */
+		if (c->sqmap != MAP_FAILED) munmap(c->sqmap, c->sqmapsize);
+		if (c->cqmapsize && c->cqmap != MAP_FAILED) munmap(c->cqmap, c->cqmapsize);
+		if (c->sqes != (struct io_uring_sqe *)MAP_FAILED) munmap(c->sqes, c->sqessize);
+		close(ring);
+		return err;
+	}
+	c->sqhead = (unsigned *)((char *)c->sqmap + p.sq_off.head);
+	c->sqtail = (unsigned *)((char *)c->sqmap + p.sq_off.tail);
+	c->sqmask = (unsigned *)((char *)c->sqmap + p.sq_off.ring_mask);
+	c->sqarray = (unsigned *)((char *)c->sqmap + p.sq_off.array);
+	c->cqhead = (unsigned *)((char *)c->cqmap + p.cq_off.head);
+	c->cqtail = (unsigned *)((char *)c->cqmap + p.cq_off.tail);
+	c->cqmask = (unsigned *)((char *)c->cqmap + p.cq_off.ring_mask);
+	c->cqes = (struct io_uring_cqe *)((char *)c->cqmap + p.cq_off.cqes);
+	c->ring = ring;
+	return 0;
+}
+
+static void closering (AioContext *c) {
+	munmap(c->sqes, c->sqessize);
+	if (c->cqmapsize) munmap(c->cqmap, c->cqmapsize);
+	munmap(c->sqmap, c->sqmapsize);
+	close(c->ring);
+	c->ring = -1;
+}
+
+/* enters the ring until it succeeds or fails for another reason than EINTR */
+static int enterring (AioContext *c, unsigned submit, unsigned wait) {
+	int res;
+	do res = (int)syscall(SYS_io_uring_enter, c->ring, submit, wait,
+	                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (res < 0 && errno == EINTR);
+	return res < 0 ? -errno : res;
+}
+
+/* moves the completed operations of the ring to list 'done' */
+static size_t reapring (AioContext *c, AioOp **done) {
+	unsigned head = *c->cqhead, n = 0;
+	unsigned tail = __atomic_load_n(c->cqtail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &c->cqes[head & *c->cqmask];
+		AioOp *op = (AioOp *)(size_t)cqe->user_data;
+		op->res = cqe->res;
+		op->next = *done;
+		*done = op;
+	}
+	__atomic_store_n(c->cqhead, head, __ATOMIC_RELEASE);
+	return n;
+}
+#endif /* LUAMEM_USE_IOURING */
+
+/* submits all queued operations, returning 0 or a negated 'errno' */
+static int submitops (AioContext *c) {
+	size_t n = c->queued;
+	if (n == 0) return 0;
+#ifdef LUAMEM_USE_IOURING
+	if (c->ring >= 0) {
+		unsigned tail = *c->sqtail;
+		AioOp *op;
+		int res;
+		for (op = c->first; op; op = op->next, tail++) {
+			unsigned i = tail & *c->sqmask;
+			struct io_uring_sqe *sqe = &c->sqes[i];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = op->fd;
+			sqe->addr = (unsigned long long)(size_t)op->buf;
+			sqe->len = (unsigned)op->len;
+			sqe->off = (unsigned long long)op->off;  /* -1 is current position */
+			sqe->user_data = (unsigned long long)(size_t)op;
+			c->sqarray[i] = i;
+		}
+		__atomic_store_n(c->sqtail, tail, __ATOMIC_RELEASE);
+		res = enterring(c, (unsigned)n, 0);
+		if (res < 0) {  /* discard the entries not consumed */
+			__atomic_store_n(c->sqtail, *c->sqhead, __ATOMIC_RELEASE);
+			return res;
+		}
+		n = (size_t)res;
+		if (n < c->queued) {  /* kernel consumed only some entries? */
+			size_t i;
+			AioOp **p = &c->first;
+			for (i = 0; i < n; i++) p = &(*p)->next;
+			c->first = *p;
+			if (c->first == NULL) c->last = &c->first;
+			c->queued -= n;
+			c->inflight += n;
+			__atomic_store_n(c->sqtail, *c->sqhead, __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+	else
+#endif /* LUAMEM_USE_IOURING */
+	{
+		pthread_mutex_lock(&c->lock);
+		while (c->nthreads < LUAMEM_AIOTHREADS && (size_t)c->nthreads < n &&
+		       pthread_create(&c->threads[c->nthreads], NULL, aioworker, c) == 0)
+			c->nthreads++;
+		if (c->nthreads == 0) {
+			pthread_mutex_unlock(&c->lock);
+			return -EAGAIN;
+		}
+		*c->lastpending = c->first;
+		c->lastpending = c->last;
+		pthread_cond_broadcast(&c->work);
+		pthread_mutex_unlock(&c->lock);
+	}
+	c->first = NULL;
+	c->last = &c->first;
+	c->queued = 0;
+	c->inflight += n;
+	return 0;
+}
+
+/*
+** Waits for at least 'n' submitted operations to complete, and returns the
+** list of completed ones.
+*/
+static AioOp *waitops (AioContext *c, size_t n, int *err) {
+	AioOp *done = NULL;
+	*err = 0;
+	if (n > c->inflight) n = c->inflight;
+#ifdef LUAMEM_USE_IOURING
+	if (c->ring >= 0) {
+		size_t count = reapring(c, &done);
+		while (count < n) {
+			int res = enterring(c, 0, (unsigned)(n - count));
+			if (res < 0) {
+				*err = res;
+				break;
+			}
+			count += reapring(c, &done);
+		}
+		c->inflight -= count;
+		return done;
+	}
+#endif /* LUAMEM_USE_IOURING */
+	pthread_mutex_lock(&c->lock);
+	while (c->ncompleted < n)
+		pthread_cond_wait(&c->done, &c->lock);
+	done = c->completed;
+	c->inflight -= c->ncompleted;
+	c->completed = NULL;
+	c->ncompleted = 0;
+	pthread_mutex_unlock(&c->lock);
+	return done;
+}
+
+/* releases the references to the values of operations in list 'op' */
+static void releaseops (lua_State *L, AioContext *c, AioOp *op) {
+	while (op) {
+		AioOp *next = op->next;
+		lua_rawgeti(L, -1, op->id);
+		luamem_pending(L, -1, -1);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, -2, op->id);
+		op->next = c->free;
+		c->free = op;
+		op = next;
+	}
+	if (c->queued + c->inflight == 0 && c->anchor != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, c->anchor);
+		c->anchor = LUA_NOREF;
+	}
+}
+
+/*
+** Waits for the submitted operations, and discards the queued ones, so the
+** context and the values of all operations are released.
+*/
+static void closeaio (lua_State *L, AioContext *c) {
+	int err;
+	AioOp *done = waitops(c, c->inflight, &err);
+	AioOp *queued = c->first;
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_broadcast(&c->work);
+	pthread_mutex_unlock(&c->lock);
+	while (c->nthreads > 0) pthread_join(c->threads[--c->nthreads], NULL);
+#ifdef LUAMEM_USE_IOURING
+	if (c->ring >= 0) closering(c);  /* cancels operations not reaped */
+#endif /* LUAMEM_USE_IOURING */
+	pthread_cond_destroy(&c->done);
+	pthread_cond_destroy(&c->work);
+	pthread_mutex_destroy(&c->lock);
+	c->first = NULL;
+	c->last = &c->first;
+	c->queued = 0;
+	c->inflight = 0;
+	c->closed = 1;
+	lua_getuservalue(L, 1);
+	releaseops(L, c, done);
+	releaseops(L, c, queued);
+	lua_pop(L, 1);
+}
+
+static int queueop (lua_State *L, int write) {
+	AioContext *c = checkaio(L);
+	int fd = (int)luaL_checkinteger(L, 2);
+	size_t len;
+	char *buf = write ? (char *)checkslice(L, 3, &len)
+	                  : (luamem_checkmemory(L, 3, NULL),
+	                     (char *)checkslice(L, 3, &len));
+	lua_Integer off = luaL_optinteger(L, 6, -1);
+	AioOp *op = c->free;
+	luaL_argcheck(L, off >= -1, 6, "invalid offset");
+	if (op == NULL) luaL_error(L, "too many pending operations");
+	c->free = op->next;
+	op->next = NULL;
+	op->id = ++c->lastid;
+	op->fd = fd;
+	op->write = write;
+	op->buf = buf;
+	op->len = len < AIOMAXLEN ? len : AIOMAXLEN;
+	op->off = (long long)off;
+	*c->last = op;
+	c->last = &op->next;
+	c->queued++;
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, op->id);  /* keep buffer alive */
+	luamem_pending(L, 3, 1);  /* 'buf' must not move until it completes */
+	if (c->anchor == LUA_NOREF) {
+		lua_pushvalue(L, 1);
+		c->anchor = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_pushinteger(L, op->id);
+	return 1;
+}
+
+static int aio_read (lua_State *L) {
+	return queueop(L, 0);
+}
+
+static int aio_write (lua_State *L) {
+	return queueop(L, 1);
+}
+
+static int aio_submit (lua_State *L) {
+	AioContext *c = checkaio(L);
+	size_t n = c->queued;
+	int err = submitops(c);
+	if (err) return luaL_error(L, "unable to submit operations (%s)", strerror(-err));
+	lua_pushinteger(L, (lua_Integer)(n - c->queued));
+	return 1;
+}
+
+static int aio_wait (lua_State *L) {
+	AioContext *c = checkaio(L);
+	lua_Integer n = luaL_optinteger(L, 2, 1);
+	lua_Integer count = 0;
+	AioOp *done, *op;
+	int err = submitops(c);
+	if (err) return luaL_error(L, "unable to submit operations (%s)", strerror(-err));
+	if (lua_isnoneornil(L, 3)) lua_newtable(L);
+	else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	done = waitops(c, n > 0 ? (size_t)n : 0, &err);
+	for (op = done; op; op = op->next, count++) {
+		if (op->res >= 0) lua_pushinteger(L, (lua_Integer)op->res);
+		else lua_pushstring(L, strerror((int)-op->res));
+		lua_rawseti(L, -2, op->id);
+	}
+	lua_getuservalue(L, 1);
+	releaseops(L, c, done);
+	lua_pop(L, 1);
+	if (err) return luaL_error(L, "unable to wait operations (%s)", strerror(-err));
+	lua_pushinteger(L, count);
+	return 2;
+}
+
+static int aio_close (lua_State *L) {
+	closeaio(L, checkaio(L));
+	return 0;
+}
+
+static int aio_len (lua_State *L) {
+	AioContext *c = checkaio(L);
+	lua_pushinteger(L, (lua_Integer)(c->queued + c->inflight));
+	return 1;
+}
+
+static int aio_gc (lua_State *L) {
+	AioContext *c = (AioContext *)lua_touserdata(L, 1);
+	if (!c->closed) closeaio(L, c);
+	return 0;
+}
+
+static int mem_aio (lua_State *L) {
+	static const char *const modes[] = {"auto", "io_uring", "threads", NULL};
+	lua_Integer size = luaL_optinteger(L, 1, LUAMEM_AIOSIZE);
+	int mode = luaL_checkoption(L, 2, "auto", modes);
+	AioContext *c;
+	size_t i;
+	luaL_argcheck(L, 1 <= size && size <= AIOMAXSIZE, 1, "invalid size");
+	c = (AioContext *)lua_newuserdata(L, sizeof(AioContext) +
+	                                     (size_t)size*sizeof(AioOp));
+	memset(c, 0, sizeof(AioContext));
+	c->size = (size_t)size;
+	c->anchor = LUA_NOREF;
+	c->ops = (AioOp *)(c + 1);
+	for (i = 0; i < c->size; i++) c->ops[i].next = i+1 < c->size ? &c->ops[i+1] : NULL;
+	c->free = c->ops;
+	c->last = &c->first;
+	c->lastpending = &c->pending;
+	c->closed = 1;  /* until fully initialized */
+	luaL_setmetatable(L, LUAMEM_AIO);
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+#ifdef LUAMEM_USE_IOURING
+	c->ring = -1;
+	if (mode != 2) {
+		int err = setupring(c);
+		if (err && mode == 1)
+			return luaL_error(L, "io_uring not available (%s)", strerror(err));
+	}
+#else /* LUAMEM_USE_IOURING */
+	if (mode == 1) return luaL_error(L, "io_uring not available");
+#endif /* LUAMEM_USE_IOURING */
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->work, NULL);
+	pthread_cond_init(&c->done, NULL);
+	c->closed = 0;
+	return 1;
+}
+
+static const luaL_Reg aiometh[] = {
+	{"read", aio_read},
+	{"write", aio_write},
+	{"submit", aio_submit},
+	{"wait", aio_wait},
+	{"close", aio_close},
+	{NULL, NULL}
+};
+
+static void createaiometa (lua_State *L) {
+	luaL_newmetatable(L, LUAMEM_AIO);
+	luaL_newlib(L, aiometh);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, aio_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, aio_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+/* }====================================================== */
+#endif /* LUAMEM_USE_AIO */
+
+
+/*
+** {======================================================
+** COMPRESSION
+** =======================================================
+*/
+
+/*
+** Compression in the LZ4 block format: a sequence of tokens with the
+** number of literals (high 4 bits) and the length of a match minus 4
+** (low 4 bits), each followed by extra length bytes when it is 15,
+** the literals, and the 2-byte little-endian offset of the match. The
+** last 5 bytes are always literals, and the last match must start at
+** least 12 bytes before the end of the block.
+*/
+
+#define LZ4MINMATCH	4
+#define LZ4LASTLITS	5
+#define LZ4MFLIMIT	12
+#define LZ4MAXOFFSET	65535
+#define LZ4HASHLOG	12
+
+#define lz4bound(n)	((n) + (n)/255 + 16)
+
+/* results of decompression besides the size of the output */
+#define LZ4CORRUPT	(~(size_t)0)
+#define LZ4NOSPACE	(~(size_t)1)
+
+static unsigned int read32 (const unsigned char *p) {
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#define lz4hash(v)	(((v) * 2654435761u) >> (32 - LZ4HASHLOG))
+
+static unsigned char *lz4len (unsigned char *op, size_t len) {
+	for (; len >= 255; len -= 255) *op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/*
+** Writes a sequence of literals 'lit' of 'nlit' bytes followed by a match
+** of 'mlen' bytes at 'off' bytes back, or no match if 'mlen' is zero.
+** Returns NULL if the sequence does not fit until 'oend'.
+*/
+static unsigned char *lz4seq (unsigned char *op, unsigned char *oend,
+                              const unsigned char *lit, size_t nlit,
+                              size_t off, size_t mlen) {
+	size_t mcode = mlen ? mlen - LZ4MINMATCH : 0;
+	if ((size_t)(oend - op) < 2 + nlit + nlit/255 + (mlen ? 3 + mcode/255 : 0))
+		return NULL;
+	*op++ = (unsigned char)(((nlit < 15 ? nlit : 15) << 4) |
+	                        (mcode < 15 ? mcode : 15));
+	if (nlit >= 15) op = lz4len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen) {
+		*op++ = (unsigned char)(off & 0xff);
+		*op++ = (unsigned char)(off >> 8);
+		if (mcode >= 15) op = lz4len(op, mcode - 15);
+	}
+	return op;
+}
+
+/*
+** Compresses 'n' bytes of 'src' into 'dst' of 'cap' bytes using 'table'
+** with '1 << LZ4HASHLOG' entries. Returns the size of the output, or
+** LZ4NOSPACE if it does not fit.
+*/
+static size_t lz4compress (const unsigned char *src, size_t n,
+                           unsigned char *dst, size_t cap,
+                           unsigned int *table) {
+	unsigned char *op = dst, *oend = dst + cap;
+	size_t ip = 0, anchor = 0;
+	if (n >= LZ4MFLIMIT + 1) {
+		size_t mflimit = n - LZ4MFLIMIT;
+		size_t mlimit = n - LZ4LASTLITS;
+		memset(table, 0, sizeof(unsigned int) << LZ4HASHLOG);
+		ip = 1;
+		while (ip < mflimit) {
+			unsigned int v = read32(src + ip);
+			unsigned int h = lz4hash(v);
+			size_t ref = table[h];
+			table[h] = (unsigned int)ip;
+			if (ref < ip && ip - ref <= LZ4MAXOFFSET && read32(src + ref) == v) {
+				size_t len = LZ4MINMATCH;
+				while (ip > anchor && ref > 0 && src[ip-1] == src[ref-1]) {
+					ip--;  /* extend the match backwards */
+					ref--;
+					len++;
+				}
+				while (ip + len < mlimit && src[ref+len] == src[ip+len]) len++;
+				op = lz4seq(op, oend, src + anchor, ip - anchor, ip - ref, len);
+				if (op == NULL) return LZ4NOSPACE;
+				ip += len;
+				anchor = ip;
+				if (ip - 2 < mflimit)
+					table[lz4hash(read32(src + ip - 2))] = (unsigned int)(ip - 2);
+			}
+			else ip += 1 + ((ip - anchor) >> 6);  /* skip faster if no matches */
+		}
+	}
+	op = lz4seq(op, oend, src + anchor, n - anchor, 0, 0);
+	if (op == NULL) return LZ4NOSPACE;
+	return (size_t)(op - dst);
+}
+
+/*
+** Reads a length extension. Returns 0 if the input ends before it.
+*/
+static int lz4readlen (const unsigned char **ip, const unsigned char *iend,
+                       size_t *len) {
+	unsigned int b;
+	do {
+		if (*ip >= iend) return 0;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 1;
+}
+
+/*
+** Decompresses 'n' bytes of 'src' into 'dst' of 'cap' bytes. Returns the
+** size of the output, or LZ4NOSPACE if it does not fit, or LZ4CORRUPT if
+** the input is invalid, in which case '*err' gets the offset of the
+** invalid sequence in 'src'.
+*/
+static size_t lz4decompress (const unsigned char *src, size_t n,
+                             unsigned char *dst, size_t cap, size_t *err) {
+	const unsigned char *ip = src, *iend = src + n;
+	unsigned char *op = dst, *oend = dst + cap;
+	while (ip < iend) {
+		const unsigned char *seq = ip;
+		unsigned int token = *ip++;
+		size_t nlit = token >> 4, off, mlen;
+		if (nlit == 15 && !lz4readlen(&ip, iend, &nlit)) goto corrupt;
+		if (nlit > (size_t)(iend - ip)) goto corrupt;
+		if (nlit > (size_t)(oend - op)) return LZ4NOSPACE;
+		if (nlit > 0) {  /* 'op' might be NULL for an empty output */
+			memcpy(op, ip, nlit);
+			op += nlit;
+			ip += nlit;
+		}
+		if (ip == iend) break;  /* last sequence has no match */
+		if (iend - ip < 2) goto corrupt;
+		off = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && !lz4readlen(&ip, iend, &mlen)) goto corrupt;
+		mlen += LZ4MINMATCH;
+		if (off == 0 || off > (size_t)(op - dst)) {
+			ip = seq;
+			goto corrupt;
+		}
+		if (mlen > (size_t)(oend - op)) return LZ4NOSPACE;
+		if (off >= mlen) memcpy(op, op - off, mlen);
+		else {  /* overlapping copy repeats the last 'off' bytes */
+			const unsigned char *ref = op - off;
+			size_t i;
+			for (i = 0; i < mlen; i++) op[i] = ref[i];
+		}
+		op += mlen;
+	}
+	return (size_t)(op - dst);
+	corrupt:
+	*err = (size_t)(ip - src);
+	return LZ4CORRUPT;
+}
+
+static int mem_compress (lua_State *L) {
+	size_t len, pos, sl, res;
+	char *mem = checkoutput(L, 1, &len, &pos);
+	const char *s = checkslice(L, 3, &sl);
+	size_t si = (size_t)(s - luamem_tostring(L, 3, NULL));
+	unsigned int *table = (unsigned int *)lua_newuserdata(L,
+	                                 sizeof(unsigned int) << LZ4HASHLOG);
+	res = lz4compress((const unsigned char *)s, sl,
+	                  (unsigned char *)mem + pos, len - pos, table);
+	if (res == LZ4NOSPACE) {
+		size_t oldlen = len;
+		luaL_argcheck(L, lz4bound(sl) <= LUAMEM_MAXALLOC - pos, 3,
+		                 "string slice too long");
+		mem = growoutput(L, 1, mem, &len, pos + lz4bound(sl));
+		s = luamem_tostring(L, 3, NULL) + si;  /* 'mem' might be 's' moved */
+		res = lz4compress((const unsigned char *)s, sl,
+		                  (unsigned char *)mem + pos, len - pos, table);
+		if (pos + res < len)  /* remove unused space */
+			resizemem(L, 1, mem, len, pos + res > oldlen ? pos + res : oldlen);
+	}
+	lua_pushinteger(L, (lua_Integer)res);
+	return 1;
+}
+
+static int mem_decompress (lua_State *L) {
+	size_t len, pos, sl, res, err = 0;
+	char *mem = checkoutput(L, 1, &len, &pos);
+	const char *s = checkslice(L, 3, &sl);
+	size_t si = (size_t)(s - luamem_tostring(L, 3, NULL));
+	size_t oldlen = len;
+	while ((res = lz4decompress((const unsigned char *)s, sl,
+	                            (unsigned char *)mem + pos, len - pos,
+	                            &err)) == LZ4NOSPACE) {
+		size_t size = (len - pos < sl ? sl : len - pos);
+		luaL_argcheck(L, size <= (LUAMEM_MAXALLOC - pos)/4, 3, "data too large");
+		mem = growoutput(L, 1, mem, &len, pos + 4*size);
+		s = luamem_tostring(L, 3, NULL) + si;  /* 'mem' might be 's' moved */
+	}
+	if (len > oldlen) {  /* remove unused space */
+		size_t size = (res != LZ4CORRUPT && pos + res > oldlen) ? pos + res
+		                                                        : oldlen;
+		resizemem(L, 1, mem, len, size);
+	}
+	if (res == LZ4CORRUPT) return invaliddata(L, 3, s + err);
+	lua_pushinteger(L, (lua_Integer)res);
+	return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** TEXT ENCODINGS
+** =======================================================
+*/
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static const char b64digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* value of each base64 digit, or 0xff for invalid characters */
+static const unsigned char b64values[256] = {
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255, 62,255,255,255, 63,
+	 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,255,255,255,255,255,255,
+	255,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,255,255,255,255,255,
+	255, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255
+};
+
+static int hexvalue (int c) {
+	if ('0' <= c && c <= '9') return c - '0';
+	c |= 0x20;  /* to lower case */
+	if ('a' <= c && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+#ifdef LUAMEM_USE_SSE2
+/* converts nibbles in 'v' to hexadecimal digits */
+static __m128i hexdigitsv (__m128i v) {
+	__m128i letter = _mm_cmpgt_epi8(v, _mm_set1_epi8(9));
+	v = _mm_add_epi8(v, _mm_set1_epi8('0'));
+	return _mm_add_epi8(v, _mm_and_si128(letter, _mm_set1_epi8('a'-'0'-10)));
+}
+
+/* converts hexadecimal digits in 'c' to nibbles, returns 0 if invalid */
+static int hexvaluesv (__m128i c, __m128i *v) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+	                         _mm_set1_epi8('a'));
+	__m128i isd = _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8(9)), zero);
+	__m128i isl = _mm_cmpeq_epi8(_mm_subs_epu8(l, _mm_set1_epi8(5)), zero);
+	*v = _mm_or_si128(_mm_and_si128(isd, d),
+	                  _mm_and_si128(isl, _mm_add_epi8(l, _mm_set1_epi8(10))));
+	return _mm_movemask_epi8(_mm_or_si128(isd, isl)) == 0xffff;
+}
+
+/* joins pairs of nibbles in 16-bit lanes of 'v' into bytes */
+static __m128i hexjoinv (__m128i v) {
+	__m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 4);
+	return _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+}
+#endif /* LUAMEM_USE_SSE2 */
+
+static void hexencode (char *out, const unsigned char *s, size_t n) {
+	size_t i = 0;
+#ifdef LUAMEM_USE_SSE2
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	for (; n - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i hi = hexdigitsv(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = hexdigitsv(_mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i *)(out + 2*i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif /* LUAMEM_USE_SSE2 */
+	for (; i < n; i++) {
+		out[2*i] = hexdigits[s[i] >> 4];
+		out[2*i+1] = hexdigits[s[i] & 0x0f];
+	}
+}
+
+/*
+** Decodes 'n' hexadecimal digits ('n' is even). Returns the index of the
+** first invalid digit, or 'n' if all are valid.
+*/
+static size_t hexdecode (char *out, const unsigned char *s, size_t n) {
+	size_t i = 0;
+#ifdef LUAMEM_USE_SSE2
+	for (; n - i >= 32; i += 32) {
+		__m128i a, b;
+		if (!hexvaluesv(_mm_loadu_si128((const __m128i *)(s + i)), &a) ||
+		    !hexvaluesv(_mm_loadu_si128((const __m128i *)(s + i + 16)), &b))
+			break;  /* let the loop below find the invalid digit */
+		_mm_storeu_si128((__m128i *)(out + i/2),
+		                 _mm_packus_epi16(hexjoinv(a), hexjoinv(b)));
+	}
+#endif /* LUAMEM_USE_SSE2 */
+	for (; i < n; i += 2) {
+		int hi = hexvalue(s[i]), lo = hexvalue(s[i+1]);
+		if (hi < 0) return i;
+		if (lo < 0) return i+1;
+		out[i/2] = (char)((hi << 4) | lo);
+	}
+	return n;
+}
+
+#ifdef LUAMEM_USE_SSSE3
+/* converts 12 bytes from 's' into 16 sextets in separate bytes */
+static __m128i b64splitv (const unsigned char *s) {
+	__m128i v = _mm_loadu_si128((const __m128i *)s);
+	__m128i a, b;
+	v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+	                                      4, 5, 3, 4, 1, 2, 0, 1));
+	a = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+	                    _mm_set1_epi32(0x04000040));
+	b = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+	                    _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(a, b);
+}
+
+/* converts sextets in 'v' to base64 digits */
+static __m128i b64digitsv (__m128i v) {
+	__m128i r = _mm_subs_epu8(v, _mm_set1_epi8(51));
+	__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), v);
+	r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+	r = _mm_shuffle_epi8(_mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52,
+	                                   '0'-52, '0'-52, '0'-52, '0'-52,
+	                                   '0'-52, '0'-52, '0'-52, '+'-62,
+	                                   '/'-63, 'A', 0, 0), r);
+	return _mm_add_epi8(r, v);
+}
+#endif /* LUAMEM_USE_SSSE3 */
+
+static void b64encode (char *out, const unsigned char *s, size_t n) {
+	size_t i = 0;
+#ifdef LUAMEM_USE_SSSE3
+	for (; n - i >= 16; i += 12, out += 16)  /* reads 4 bytes ahead */
+		_mm_storeu_si128((__m128i *)out, b64digitsv(b64splitv(s + i)));
+#endif /* LUAMEM_USE_SSSE3 */
+	for (; n - i >= 3; i += 3, out += 4) {
+		unsigned long v = ((unsigned long)s[i] << 16) | (s[i+1] << 8) | s[i+2];
+		out[0] = b64digits[v >> 18];
+		out[1] = b64digits[(v >> 12) & 0x3f];
+		out[2] = b64digits[(v >> 6) & 0x3f];
+		out[3] = b64digits[v & 0x3f];
+	}
+	if (i < n) {
+		unsigned long v = (unsigned long)s[i] << 16;
+		if (i+1 < n) v |= s[i+1] << 8;
+		out[0] = b64digits[v >> 18];
+		out[1] = b64digits[(v >> 12) & 0x3f];
+		out[2] = (i+1 < n) ? b64digits[(v >> 6) & 0x3f] : '=';
+		out[3] = '=';
+	}
+}
+
+/* number of bytes encoded by 'n' base64 digits, ignoring validity */
+static size_t b64size (const unsigned char *s, size_t n) {
+	size_t size = n/4*3;
+	if (n >= 4 && s[n-1] == '=') size -= (s[n-2] == '=') ? 2 : 1;
+	return size;
+}
+
+/*
+** Decodes 'n' base64 digits ('n' is a multiple of 4). Returns the index
+** of the first invalid digit, or 'n' if all are valid.
+*/
+static size_t b64decode (char *out, const unsigned char *s, size_t n) {
+	size_t i;
+	size_t last = (n >= 4 && s[n-1] == '=') ? n-4 : n;  /* padded group */
+	for (i = 0; i < last; i += 4, out += 3) {
+		unsigned int a = b64values[s[i]], b = b64values[s[i+1]];
+		unsigned int c = b64values[s[i+2]], d = b64values[s[i+3]];
+		if ((a | b | c | d) & 0x80) break;
+		out[0] = (char)((a << 2) | (b >> 4));
+		out[1] = (char)((b << 4) | (c >> 2));
+		out[2] = (char)((c << 6) | d);
+	}
+	if (i < n) {  /* invalid digit or padded group */
+		unsigned int v[4];
+		int k, pad = 0;
+		for (k = 0; k < 4; k++) {
+			v[k] = b64values[s[i+k]];
+			if (i == last && k >= 2 && s[i+k] == '=' && (k == 3 || s[i+3] == '=')) {
+				v[k] = 0;
+				pad++;
+			}
+			else if (v[k] & 0x80) return i+k;
+		}
+		out[0] = (char)((v[0] << 2) | (v[1] >> 4));
+		if (pad < 2) out[1] = (char)((v[1] << 4) | (v[2] >> 2));
+	}
+	return n;
+}
+
+static int mem_tohex (lua_State *L) {
+	size_t len, pos, sl;
+	char *mem = checkoutput(L, 1, &len, &pos);
+	const char *s = checkslice(L, 3, &sl);
+	size_t si = (size_t)(s - luamem_tostring(L, 3, NULL));
+	luaL_argcheck(L, sl <= LUAMEM_MAXALLOC/2, 3, "string slice too long");
+	mem = checkroom(L, 1, mem, &len, pos, 2*sl);
+	s = luamem_tostring(L, 3, NULL) + si;  /* 'mem' might be 's' moved */
+	hexencode(mem + pos, (const unsigned char *)s, sl);
+	lua_pushinteger(L, (lua_Integer)(2*sl));
+	return 1;
+}
+
+static int mem_fromhex (lua_State *L) {
+	size_t len, pos, sl, err, olen;
+	char *mem = checkoutput(L, 1, &len, &pos);
+	const char *s = checkslice(L, 3, &sl);
+	size_t si = (size_t)(s - luamem_tostring(L, 3, NULL));
+	olen = len;
+	mem = checkroom(L, 1, mem, &len, pos, sl/2);
+	s = luamem_tostring(L, 3, NULL) + si;  /* 'mem' might be 's' moved */
+	err = hexdecode(mem + pos, (const unsigned char *)s, sl & ~(size_t)1);
+	if (err < sl) {
+		invaliddata(L, 3, s + err);
+		if (len != olen) resizemem(L, 1, mem, len, olen);  /* undo growth */
+		return 2;
+	}
+	lua_pushinteger(L, (lua_Integer)(sl/2));
+	return 1;
+}
+
+static int mem_tobase64 (lua_State *L) {
+	size_t len, pos, sl, n;
+	char *mem = checkoutput(L, 1, &len, &pos);
+	const char *s = checkslice(L, 3, &sl);
+	size_t si = (size_t)(s - luamem_tostring(L, 3, NULL));
+	luaL_argcheck(L, sl <= LUAMEM_MAXALLOC/4*3, 3, "string slice too long");
+	n = (sl + 2)/3*4;
+	mem = checkroom(L, 1, mem, &len, pos, n);
+	s = luamem_tostring(L, 3, NULL) + si;  /* 'mem' might be 's' moved */
+	b64encode(mem + pos, (const unsigned char *)s, sl);
+	lua_pushinteger(L, (lua_Integer)n);
+	return 1;
+}
+
+static int mem_frombase64 (lua_State *L) {
+	size_t len, pos, sl, n, err, olen;
+	char *mem = checkoutput(L, 1, &len, &pos);
+	const char *s = checkslice(L, 3, &sl);
+	size_t si = (size_t)(s - luamem_tostring(L, 3, NULL));
+	n = b64size((const unsigned char *)s, sl & ~(size_t)3);
+	olen = len;
+	mem = checkroom(L, 1, mem, &len, pos, n);
+	s = luamem_tostring(L, 3, NULL) + si;  /* 'mem' might be 's' moved */
+	err = b64decode(mem + pos, (const unsigned char *)s, sl & ~(size_t)3);
+	if (err < sl) {
+		invaliddata(L, 3, s + err);
+		if (len != olen) resizemem(L, 1, mem, len, olen);  /* undo growth */
+		return 2;
+	}
+	lua_pushinteger(L, (lua_Integer)n);
+	return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** UTF-8
+** =======================================================
+*/
+
+#define iscont(c)	(((c) & 0xC0) == 0x80)
+
+/*
+** Returns the first position from 'i' until 'n' of a byte of 's' that is
+** not ASCII, or 'n' if there is none.
+*/
+static size_t skipascii (const unsigned char *s, size_t i, size_t n) {
+#ifdef LUAMEM_USE_SSE2
+	for (; n - i >= 16; i += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+		if (mask != 0) return i + __builtin_ctz(mask);
+	}
+#endif /* LUAMEM_USE_SSE2 */
+	for (; n - i >= sizeof(size_t); i += sizeof(size_t)) {
+		size_t w;
+		memcpy(&w, s + i, sizeof(size_t));
+		if (w & ((size_t)-1 / 0xff * 0x80)) break;
+	}
+	while (i < n && s[i] < 0x80) i++;
+	return i;
+}
+
+/*
+** Decodes the non-ASCII UTF-8 sequence at position 'i' of the 'n' bytes
+** of 's' into '*code'. Returns the size of the sequence, or 0 if it is
+** invalid, overlong, a surrogate, or above U+10FFFF.
+*/
+static size_t utf8decode (const unsigned char *s, size_t i, size_t n,
+                          lua_Integer *code) {
+	static const unsigned int limits[] = {0x80, 0x800, 0x10000};
+	unsigned int c = s[i], res;
+	size_t count, k;
+	if (c < 0xC2 || c > 0xF4) return 0;  /* continuation, overlong or too big */
+	count = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+	if (n - i <= count) return 0;
+	res = c & (0x3F >> count);
+	for (k = 1; k <= count; k++) {
+		c = s[i+k];
+		if (!iscont(c)) return 0;
+		res = (res << 6) | (c & 0x3F);
+	}
+	if (res < limits[count-1] || res > 0x10FFFF ||
+	    (0xD800 <= res && res <= 0xDFFF)) return 0;
+	*code = (lua_Integer)res;
+	return count + 1;
+}
+
+#ifdef LUAMEM_USE_SSSE3
+#define TOOSHORT	(1 << 0)
+#define TOOLONG	(1 << 1)
+#define OVERLONG3	(1 << 2)
+#define TOOLARGE	(1 << 3)
+#define SURROGATE	(1 << 4)
+#define OVERLONG2	(1 << 5)
+#define TOOLARGE1000	(1 << 6)
+#define OVERLONG4	(1 << 6)
+#define TWOCONTS	(1 << 7)
+#define CARRY	(TOOSHORT | TOOLONG | TWOCONTS)
+
+/*
+** Validates the 'n' bytes of 's' in blocks of 16 bytes, classifying the
+** errors of each pair of bytes by the nibbles of both with table lookups
+** (J. Keiser and D. Lemire, "Validating UTF-8 In Less Than One Instruction
+** Per Byte"). Returns the start of the last character of the blocks found
+** valid, from where the remaining bytes must be checked one by one, and
+** sets '*count' to the number of characters before it.
+*/
+static size_t utf8blocks (const unsigned char *s, size_t n, size_t *count) {
+	const __m128i byte1high = _mm_setr_epi8(
+		TOOLONG, TOOLONG, TOOLONG, TOOLONG, TOOLONG, TOOLONG, TOOLONG, TOOLONG,
+		TWOCONTS, TWOCONTS, TWOCONTS, TWOCONTS,
+		TOOSHORT | OVERLONG2,
+		TOOSHORT,
+		TOOSHORT | OVERLONG3 | SURROGATE,
+		TOOSHORT | TOOLARGE | TOOLARGE1000 | OVERLONG4);
+	const __m128i byte1low = _mm_setr_epi8(
+		CARRY | OVERLONG3 | OVERLONG2 | OVERLONG4,
+		CARRY | OVERLONG2,
+		CARRY,
+		CARRY,
+		CARRY | TOOLARGE,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000 | SURROGATE,
+		CARRY | TOOLARGE | TOOLARGE1000,
+		CARRY | TOOLARGE | TOOLARGE1000);
+	const __m128i byte2high = _mm_setr_epi8(
+		TOOSHORT, TOOSHORT, TOOSHORT, TOOSHORT,
+		TOOSHORT, TOOSHORT, TOOSHORT, TOOSHORT,
+		TOOLONG | OVERLONG2 | TWOCONTS | OVERLONG3 | TOOLARGE1000 | OVERLONG4,
+		TOOLONG | OVERLONG2 | TWOCONTS | OVERLONG3 | TOOLARGE,
+		TOOLONG | OVERLONG2 | TWOCONTS | SURROGATE | TOOLARGE,
+		TOOLONG | OVERLONG2 | TWOCONTS | SURROGATE | TOOLARGE,
+		TOOSHORT, TOOSHORT, TOOSHORT, TOOSHORT);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i prev = _mm_setzero_si128();
+	size_t i, chars = 0;
+	for (i = 0; n - i >= 16; i += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i prev1, prev2, prev3, err, must23;
+		if ((_mm_movemask_epi8(in) | (_mm_movemask_epi8(prev) & 0xe000)) == 0) {
+			chars += 16;  /* ASCII not following an incomplete character */
+			prev = in;
+			continue;
+		}
+		prev1 = _mm_alignr_epi8(in, prev, 15);
+		prev2 = _mm_alignr_epi8(in, prev, 14);
+		prev3 = _mm_alignr_epi8(in, prev, 13);
+		err = _mm_and_si128(_mm_and_si128(
+			_mm_shuffle_epi8(byte1high,
+			                 _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+			_mm_shuffle_epi8(byte1low, _mm_and_si128(prev1, nibble))),
+			_mm_shuffle_epi8(byte2high,
+			                 _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+		must23 = _mm_or_si128(  /* third and fourth bytes */
+			_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+			_mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+		err = _mm_xor_si128(err, _mm_and_si128(must23, _mm_set1_epi8((char)0x80)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) != 0xffff)
+			break;
+		chars += 16 - __builtin_popcount(_mm_movemask_epi8(  /* continuations */
+			_mm_cmplt_epi8(in, _mm_set1_epi8((char)0xC0))));
+		prev = in;
+	}
+	if (i > 0) {  /* last character might continue after 'i' */
+		size_t b = i - 1;
+		while (b > i - 4 && iscont(s[b])) b--;
+		chars--;
+		i = b;
+	}
+	*count = chars;
+	return i;
+}
+#endif /* LUAMEM_USE_SSSE3 */
+
+/*
+** Returns the position of the first invalid byte in the 'n' bytes of 's',
+** or 'n' if they are valid UTF-8, and sets '*count' the number of
+** characters before it.
+*/
+static size_t utf8check (const char *str, size_t n, size_t *count) {
+	const unsigned char *s = (const unsigned char *)str;
+	size_t i = 0, chars = 0;
+#ifdef LUAMEM_USE_SSSE3
+	i = utf8blocks(s, n, &chars);
+#endif /* LUAMEM_USE_SSSE3 */
+	while (i < n) {
+		unsigned int c = s[i], c1;
+		if (c < 0x80) {
+			size_t ascii = skipascii(s, i + 1, n);
+			chars += ascii - i;
+			i = ascii;
+			continue;
+		}
+		if (c < 0xC2 || c > 0xF4) break;
+		c1 = i + 1 < n ? s[i+1] : 0;
+		if (!iscont(c1)) break;
+		if (c < 0xE0) i += 2;
+		else {
+			if ((c == 0xE0 && c1 < 0xA0) || (c == 0xED && c1 > 0x9F) ||  /* overlong or surrogate */
+			    (c == 0xF0 && c1 < 0x90) || (c == 0xF4 && c1 > 0x8F) ||  /* overlong or too big */
+			    n - i < 3 || !iscont(s[i+2]))
+				break;
+			if (c < 0xF0) i += 3;
+			else if (n - i < 4 || !iscont(s[i+3])) break;
+			else i += 4;
+		}
+		chars++;
+	}
+	*count = chars;
+	return i;
+}
+
+static int mem_utf8valid (lua_State *L) {
+	size_t len, count;
+	const char *s = checkslice(L, 1, &len);
+	size_t err = utf8check(s, len, &count);
+	if (err < len) return invaliddata(L, 1, s + err);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int mem_utf8len (lua_State *L) {
+	size_t len, count;
+	const char *s = checkslice(L, 1, &len);
+	size_t err = utf8check(s, len, &count);
+	if (err < len) return invaliddata(L, 1, s + err);
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+static int utf8next (lua_State *L) {
+	size_t len;
+	const unsigned char *s = (const unsigned char *)luamem_checkstring(L, 1, &len);
+	lua_Integer end = lua_tointeger(L, lua_upvalueindex(1));
+	lua_Integer n = lua_tointeger(L, 2) - 1;
+	lua_Integer code;
+	if (end > (lua_Integer)len) end = (lua_Integer)len;
+	if (n < 0) n = -n - 1;  /* first code */
+	else if (n < end) {  /* skip the previous code, which was valid */
+		int c = s[n];
+		n += c < 0x80 ? 1 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+	}
+	if (n >= end) return 0;  /* no more codepoints */
+	if (s[n] < 0x80) code = s[n];
+	else if (utf8decode(s, (size_t)n, (size_t)end, &code) == 0)
+		return luaL_error(L, "invalid UTF-8 code");
+	lua_pushinteger(L, n + 1);
+	lua_pushinteger(L, code);
+	return 2;
+}
+
+static int mem_utf8codes (lua_State *L) {
+	size_t len;
+	const char *s = checkslice(L, 1, &len);
+	lua_Integer start = (lua_Integer)(s - luamem_tostring(L, 1, NULL));
+	lua_pushinteger(L, start + (lua_Integer)len);
+	lua_pushcclosure(L, utf8next, 1);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, -start);  /* first code has no previous one */
+	return 3;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** SPLITTING
+** =======================================================
+*/
+
+/*
+** Gets the contents to be split of the string or memory at index 1 from
+** the position at 'arg' until the position at 'arg+1', setting '*pos' and
+** '*end' to their offsets.
+*/
+static const char *checkfields (lua_State *L, int arg, size_t *pos,
+                                                       size_t *end) {
+	size_t len;
+	const char *s = luamem_checkstring(L, 1, &len);
+	lua_Integer posi = posrelat(luaL_optinteger(L, arg, 1), len);
+	lua_Integer pose = posrelat(luaL_optinteger(L, arg+1, -1), len);
+	if (posi < 1) posi = 1;
+	if (pose > (lua_Integer)len) pose = len;
+	*pos = (size_t)posi - 1;
+	*end = posi > pose ? *pos : (size_t)pose;
+	return s;
+}
+
+/*
+** Stores in the table at index 't' the start and end positions of all the
+** fields of 's' from 'pos' until 'end' separated by 'd', and returns the
+** number of fields. Lines do not include an empty last field.
+*/
+static int splitall (lua_State *L, const char *s, size_t pos, size_t end,
+                     const char *d, size_t dl, int lines, int t) {
+	lua_Integer n = 0;
+	luaL_checktype(L, t, LUA_TTABLE);
+	while (!(lines && pos == end)) {
+		const char *e = lmemfind(s + pos, end - pos, d, dl);
+		size_t fe = e ? (size_t)(e - s) : end;
+		lua_pushinteger(L, (lua_Integer)pos + 1);
+		lua_rawseti(L, t, ++n);
+		lua_pushinteger(L, (lua_Integer)fe);
+		lua_rawseti(L, t, ++n);
+		if (e == NULL) break;
+		pos = fe + dl;
+	}
+	lua_pushinteger(L, n/2);
+	return 1;
+}
+
+static int splitnext (lua_State *L) {
+	size_t len, dl, fe;
+	const char *s = luamem_tostring(L, lua_upvalueindex(1), &len);
+	const char *d = luamem_tostring(L, lua_upvalueindex(2), &dl);
+	lua_Integer pos = lua_tointeger(L, lua_upvalueindex(3));
+	lua_Integer end = lua_tointeger(L, lua_upvalueindex(4));
+	const char *e;
+	if (end > (lua_Integer)len) end = (lua_Integer)len;  /* memory shrunk? */
+	if (pos < 0 || pos > end ||
+	    (pos == end && lua_toboolean(L, lua_upvalueindex(5))))
+		return 0;  /* no more fields */
+	e = lmemfind(s + pos, (size_t)(end - pos), d, dl);
+	fe = e ? (size_t)(e - s) : (size_t)end;
+	lua_pushinteger(L, e ? (lua_Integer)(fe + dl) : -1);
+	lua_replace(L, lua_upvalueindex(3));
+	lua_pushinteger(L, pos + 1);
+	lua_pushinteger(L, (lua_Integer)fe);
+	return 2;
+}
+
+/*
+** Splits the contents selected by arguments 'arg' and 'arg+1' at the
+** delimiter at index 'darg', or at line breaks if 'darg' is 0.
+*/
+static int splitfields (lua_State *L, int darg, int arg) {
+	size_t pos, end, dl = 1;
+	const char *s = checkfields(L, arg, &pos, &end);
+	const char *d = darg ? luamem_checkstring(L, darg, &dl) : "\n";
+	luaL_argcheck(L, dl > 0, darg, "empty delimiter");
+	if (!lua_isnoneornil(L, arg+2))
+		return splitall(L, s, pos, end, d, dl, darg == 0, arg+2);
+	lua_pushvalue(L, 1);
+	if (darg) lua_pushvalue(L, darg);
+	else lua_pushliteral(L, "\n");
+	lua_pushinteger(L, (lua_Integer)pos);
+	lua_pushinteger(L, (lua_Integer)end);
+	lua_pushboolean(L, darg == 0);
+	lua_pushcclosure(L, splitnext, 5);
+	return 1;
+}
+
+static int mem_split (lua_State *L) {
+	return splitfields(L, 2, 3);
+}
+
+static int mem_lines (lua_State *L) {
+	return splitfields(L, 0, 2);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** BYTE ORDER
+** =======================================================
+*/
+
+#ifndef _KERNEL
+#define bswap16(v)	__builtin_bswap16(v)
+#define bswap32(v)	__builtin_bswap32(v)
+#define bswap64(v)	__builtin_bswap64(v)
+#else /* _KERNEL */
+#define bswap16(v)	swab16(v)
+#define bswap32(v)	swab32(v)
+#define bswap64(v)	swab64(v)
+#endif /* _KERNEL */
+
+#define swapeach(T,p,n,f)	{ \
+	T v_; \
+	for (; i < (n); i++) { \
+		memcpy(&v_, (p) + i*sizeof(T), sizeof(T)); \
+		v_ = f(v_); \
+		memcpy((p) + i*sizeof(T), &v_, sizeof(T)); \
+	} }
+
+#ifdef LUAMEM_USE_SSSE3
+#define swapvec(p,n,w,mask)	{ \
+	const __m128i m_ = (mask); \
+	for (; (n) - i >= 16/(w); i += 16/(w)) { \
+		__m128i *v_ = (__m128i *)((p) + i*(w)); \
+		_mm_storeu_si128(v_, _mm_shuffle_epi8(_mm_loadu_si128(v_), m_)); \
+	} }
+#else /* LUAMEM_USE_SSSE3 */
+#define swapvec(p,n,w,mask)	((void)0)
+#endif /* LUAMEM_USE_SSSE3 */
+
+/*
+** Reverses the order of the bytes of each of the 'n' elements of 'width'
+** bytes in 'p'.
+*/
+static void byteswap (char *p, size_t n, int width) {
+	size_t i = 0;
+	switch (width) {
+		case 1: break;
+		case 2:
+			swapvec(p, n, 2, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+			                               9, 8, 11, 10, 13, 12, 15, 14));
+			swapeach(unsigned short, p, n, bswap16);
+			break;
+		case 4:
+			swapvec(p, n, 4, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+			                               11, 10, 9, 8, 15, 14, 13, 12));
+			swapeach(unsigned int, p, n, bswap32);
+			break;
+		case 8:
+			swapvec(p, n, 8, _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+			                               15, 14, 13, 12, 11, 10, 9, 8));
+			swapeach(unsigned long long, p, n, bswap64);
+			break;
+		default:
+			for (; i < n; i++, p += width) {
+				char *b = p, *e = p + width - 1;
+				for (; b < e; b++, e--) {
+					char c = *b;
+					*b = *e;
+					*e = c;
+				}
+			}
+	}
+}
+
+static int mem_bswap (lua_State *L) {
+	size_t len;
+	char *p = luamem_checkmemory(L, 1, &len);
+	lua_Integer width = luaL_checkinteger(L, 2);
+	lua_Integer i = posrelat(luaL_optinteger(L, 3, 1), len);
+	lua_Integer j = posrelat(luaL_optinteger(L, 4, -1), len);
+	luaL_argcheck(L, 1 <= width && width <= 16, 2,
+	                 "width out of limits [1,16]");
+	if (i <= j) {
+		size_t n = (size_t)(j-i+1);
+		luaL_argcheck(L, 1 <= i && i <= (lua_Integer)len, 3, "index out of bounds");
+		luaL_argcheck(L, 1 <= j && j <= (lua_Integer)len, 4, "index out of bounds");
+		luaL_argcheck(L, n % width == 0, 4, "range is not a multiple of width");
+		byteswap(p+i-1, n/width, (int)width);
+	}
+	return 0;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** BITSETS
+** =======================================================
+*/
+
+/*
+** Bits are numbered from 1, starting from the least significant bit of
+** the first byte.
+*/
+
+#ifndef _KERNEL
+#define popcount64(v)	__builtin_popcountll(v)
+#else /* _KERNEL */
+#define popcount64(v)	hweight64(v)
+#endif /* _KERNEL */
+
+static size_t checkbit (lua_State *L, int arg, size_t len, int *mask) {
+	lua_Integer bit = luaL_checkinteger(L, arg);
+	luaL_argcheck(L, 1 <= bit && (lua_Unsigned)(bit - 1)/8 < len, arg,
+	                 "index out of bounds");
+	*mask = 1 << ((bit - 1) % 8);
+	return (size_t)(bit - 1)/8;
+}
+
+static int changebit (lua_State *L, int value) {
+	size_t len;
+	int mask;
+	char *p = luamem_checkmemory(L, 1, &len);
+	size_t i = checkbit(L, 2, len, &mask);
+	lua_pushboolean(L, p[i] & mask);
+	if (value) p[i] |= mask;
+	else p[i] &= ~mask;
+	return 1;
+}
+
+static int mem_bitset (lua_State *L) {
+	return changebit(L, 1);
+}
+
+static int mem_bitclear (lua_State *L) {
+	return changebit(L, 0);
+}
+
+static int mem_bittest (lua_State *L) {
+	size_t len;
+	int mask;
+	const char *p = luamem_checkstring(L, 1, &len);
+	size_t i = checkbit(L, 2, len, &mask);
+	lua_pushboolean(L, p[i] & mask);
+	return 1;
+}
+
+static int mem_popcount (lua_State *L) {
+	size_t len, i, count = 0;
+	const unsigned char *p = (const unsigned char *)checkslice(L, 1, &len);
+	for (i = 0; len - i >= 4*sizeof(unsigned long long);
+	     i += 4*sizeof(unsigned long long)) {
+		unsigned long long w[4];
+		memcpy(w, p + i, sizeof(w));
+		count += popcount64(w[0]) + popcount64(w[1]) +
+		         popcount64(w[2]) + popcount64(w[3]);
+	}
+	for (; i < len; i++) count += popcount64(p[i]);
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+/*
+** Finds the first bit from 'from' with the given value, skipping a word at
+** a time the words with no such bit.
+*/
+static int mem_nextbit (lua_State *L) {
+	size_t len, i;
+	const unsigned char *p =
+		(const unsigned char *)luamem_checkstring(L, 1, &len);
+	lua_Integer from = luaL_optinteger(L, 2, 1);
+	int inv = lua_isnoneornil(L, 3) || lua_toboolean(L, 3) ? 0 : 0xff;
+	unsigned int c;
+	if (from < 1) from = 1;
+	if ((lua_Unsigned)(from - 1)/8 >= len) return 0;
+	i = (size_t)(from - 1)/8;
+	c = (p[i] ^ inv) & (0xffu << ((from - 1) % 8));  /* bits from 'from' */
+	if (c == 0) {
+		size_t skip = inv ? ~(size_t)0 : 0, w;
+		for (i++; len - i >= sizeof(size_t); i += sizeof(size_t)) {
+			memcpy(&w, p + i, sizeof(size_t));
+			if (w != skip) break;
+		}
+		for (; i < len && (c = p[i] ^ inv) == 0; i++);
+		if (i == len) return 0;
+	}
+	lua_pushinteger(L, (lua_Integer)i*8 + __builtin_ctz(c) + 1);
+	return 1;
+}
+
+/* }====================================================== */
+
+
+static int mem_convert (lua_State *L);
+static int mem_delta (lua_State *L);
+static int mem_patch (lua_State *L);
+static int mem_pack (lua_State *L);
+static int mem_packappend (lua_State *L);
+static int mem_unpack (lua_State *L);
+static int mem_sort (lua_State *L);
+static int mem_bsearch (lua_State *L);
+static int mem_encode (lua_State *L);
+static int mem_decode (lua_State *L);
+
+static const luaL_Reg lib[] = {
+	{"create", mem_create},
+	{"type", mem_type},
+	{"resize", mem_resize},
+	{"release", mem_release},
+	{"pressure", mem_pressure},
+	{"alignment", mem_alignment},
+	{"snapshot", mem_snapshot},
+	{"delta", mem_delta},
+	{"patch", mem_patch},
+	{"len", mem_len},
+	{"diff", mem_diff},
+	{"find", mem_find},
+	{"fill", mem_fill},
+	{"get", mem_get},
+	{"set", mem_set},
+	{"totable", mem_totable},
+	{"fromtable", mem_fromtable},
+	{"pack", mem_pack},
+	{"packappend", mem_packappend},
+	{"unpack", mem_unpack},
+	{"tostring", mem_tostring},
+	{"ring", mem_ring},
+	{"index", mem_index},
+#ifdef LUAMEM_USE_AIO
+	{"aio", mem_aio},
+#endif /* LUAMEM_USE_AIO */
+	{"setthreads", mem_setthreads},
+	{"compress", mem_compress},
+	{"decompress", mem_decompress},
+	{"tohex", mem_tohex},
+	{"fromhex", mem_fromhex},
+	{"tobase64", mem_tobase64},
+	{"frombase64", mem_frombase64},
+	{"utf8valid", mem_utf8valid},
+	{"utf8len", mem_utf8len},
+	{"utf8codes", mem_utf8codes},
+	{"split", mem_split},
+	{"lines", mem_lines},
+	{"bswap", mem_bswap},
+	{"convert", mem_convert},
+	{"bitset", mem_bitset},
+	{"bitclear", mem_bitclear},
+	{"bittest", mem_bittest},
+	{"popcount", mem_popcount},
+	{"nextbit", mem_nextbit},
+	{"sort", mem_sort},
+	{"bsearch", mem_bsearch},
+	{"encode", mem_encode},
+	{"decode", mem_decode},
+	{NULL, NULL}
+};
+
+static const luaL_Reg meta[] = {
+	{"__len", mem_len},
+	{"__tostring", mem_tostring},
+	{NULL, NULL}
+};
+
+
+static void setupmetatable (lua_State *L) {
+	if (lua_getmetatable(L, -1)) {
+		luaL_setfuncs(L, meta, 0);  /* add metamethods to metatable */
+		lua_pushvalue(L, 1);  /* push library */
+		lua_setfield(L, -2, "__index");  /* metatable.__index = library */
+		lua_pop(L, 1);  /* pop metatable */
+	}
+	lua_pop(L, 1);  /* pop memory */
+}
+
+
+/*
+** {======================================================
+** PROFILING
+** =======================================================
+*/
+
+#ifdef LUAMEM_PROFILE
+
+/* number of classes of duration, by powers of 2 of cycles */
+#define PROFCLASSES	48
+
+typedef struct Profile {
+	unsigned long long calls;
+	unsigned long long bytes;  /* bytes of strings and memories in arguments */
+	unsigned long long cycles;  /* total of calls that returned */
+	unsigned long long durations[PROFCLASSES];  /* calls by log2 of cycles */
+} Profile;
+
+static unsigned long long getcycles (void) {
+#if defined(_KERNEL)
+	return (unsigned long long)get_cycles();
+#elif defined(__i386__) || defined(__x86_64__)
+	return (unsigned long long)__rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+** Calls library function 'lib[i]' with index 'i' as the second upvalue,
+** recording it in the array of 'Profile' which is the first upvalue.
+*/
+static int profiled (lua_State *L) {
+	Profile *p = (Profile *)lua_touserdata(L, lua_upvalueindex(1));
+	int i = (int)lua_tointeger(L, lua_upvalueindex(2));
+	int arg, n = lua_gettop(L);
+	unsigned long long start, cycles;
+	int class;
+	p += i;
+	p->calls++;
+	for (arg = 1; arg <= n; arg++) {
+		size_t len;
+		if (lua_type(L, arg) == LUA_TSTRING) lua_tolstring(L, arg, &len);
+		else luamem_tomemoryx(L, arg, &len, NULL, NULL);
+		p->bytes += len;
+	}
+	start = getcycles();
+	n = lib[i].func(L);
+	cycles = getcycles() - start;
+	p->cycles += cycles;
+	class = cycles ? 63 - __builtin_clzll(cycles) : 0;
+	p->durations[class < PROFCLASSES ? class : PROFCLASSES - 1]++;
+	return n;
+}
+
+static int mem_profile (lua_State *L) {
+	Profile *p = (Profile *)lua_touserdata(L, lua_upvalueindex(1));
+	int i, reset = lua_toboolean(L, 1);
+	lua_newtable(L);
+	for (i = 0; lib[i].name; i++) if (p[i].calls) {
+		int c, last = 0;
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, (lua_Integer)p[i].calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, (lua_Integer)p[i].bytes);
+		lua_setfield(L, -2, "bytes");
+		lua_pushinteger(L, (lua_Integer)p[i].cycles);
+		lua_setfield(L, -2, "cycles");
+		for (c = 0; c < PROFCLASSES; c++) if (p[i].durations[c]) last = c + 1;
+		lua_createtable(L, last, 0);
+		for (c = 0; c < last; c++) {
+			lua_pushinteger(L, (lua_Integer)p[i].durations[c]);
+			lua_rawseti(L, -2, c + 1);
+		}
+		lua_setfield(L, -2, "durations");
+		lua_setfield(L, -2, lib[i].name);
+		if (reset) memset(&p[i], 0, sizeof(Profile));
+	}
+	return 1;
+}
+
+/*
+** Replaces the functions of library at the top of the stack by closures
+** that record their use, and adds function 'profile' to report it.
+*/
+static void profilelib (lua_State *L) {
+	int i, n;
+	Profile *p;
+	for (n = 0; lib[n].name; n++);
+	p = (Profile *)lua_newuserdata(L, n * sizeof(Profile));
+	memset(p, 0, n * sizeof(Profile));
+	for (i = 0; i < n; i++) {
+		lua_pushvalue(L, -1);
+		lua_pushinteger(L, i);
+		lua_pushcclosure(L, profiled, 2);
+		lua_setfield(L, -3, lib[i].name);
+	}
+	lua_pushcclosure(L, mem_profile, 1);
+	lua_setfield(L, -2, "profile");
+}
+
+#endif /* LUAMEM_PROFILE */
+
+/* }====================================================== */
+
+
+LUAMEMMOD_API int luaopen_memory (lua_State *L) {
+	luaL_newlib(L, lib);
+#ifdef LUAMEM_PROFILE
+	profilelib(L);
+#endif
+	luamem_newalloc(L, 0);
+	setupmetatable(L);
+	luamem_newref(L);
+	setupmetatable(L);
+	createringmeta(L);
+	createindexmeta(L);
+#ifdef LUAMEM_USE_THREADS
+	usepool(L);
+#endif /* LUAMEM_USE_THREADS */
+#ifdef LUAMEM_USE_AIO
+	createaiometa(L);
+#endif /* LUAMEM_USE_AIO */
+	return 1;
+}
+
+#ifdef _KERNEL
+MODULE_LICENSE("Dual MIT/BSD");
+MODULE_DESCRIPTION("Library for manipulation of memory areas in Lua");
+
+EXPORT_SYMBOL(luamem_account);
+EXPORT_SYMBOL(luamem_addvalue);
+EXPORT_SYMBOL(luamem_allocated);
+EXPORT_SYMBOL(luamem_checklenarg);
+EXPORT_SYMBOL(luamem_checkmemory);
+EXPORT_SYMBOL(luamem_checkstring);
+EXPORT_SYMBOL(luamem_free);
+EXPORT_SYMBOL(luamem_isstring);
+EXPORT_SYMBOL(luamem_newalloc);
+EXPORT_SYMBOL(luamem_newref);
+EXPORT_SYMBOL(luamem_pending);
+EXPORT_SYMBOL(luamem_pushresult);
+EXPORT_SYMBOL(luamem_pushresultsize);
+EXPORT_SYMBOL(luamem_realloc);
+EXPORT_SYMBOL(luamem_setpressure);
+EXPORT_SYMBOL(luamem_setref);
+EXPORT_SYMBOL(luamem_tomemoryx);
+EXPORT_SYMBOL(luamem_tostring);
+EXPORT_SYMBOL(luamem_type);
+EXPORT_SYMBOL(luaopen_memory);
+
+static int __init modinit (void) {
+	return 0;
+}
+
+static void __exit modexit (void) {
+}
+
+module_init(modinit);
+module_exit(modexit);
+#endif /* _KERNEL */
+
+/*
+* NOTE: most of the code below is copied from the source of Lua 5.3.1 by
+*       R. Ierusalimschy, L. H. de Figueiredo, W. Celes - Lua.org, PUC-Rio.
+*
+* Copyright (C) 1994-2015 Lua.org, PUC-Rio.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+/* macro to 'unsign' a character */
+#define uchar(c)	((unsigned char)(c))
+
+
+/* translate a relative string position: negative means back from end */
+static lua_Integer posrelat (lua_Integer pos, size_t len) {
+	if (pos >= 0) return pos;
+	else if (0u - (size_t)pos > len) return 0;
+	else return (lua_Integer)len + pos + 1;
+}
+
+static int str2byte (lua_State *L, const char *s, size_t l) {
+	lua_Integer posi = posrelat(luaL_optinteger(L, 2, 1), l);
+	lua_Integer pose = posrelat(luaL_optinteger(L, 3, posi), l);
+	int n, i;
+	if (posi < 1) posi = 1;
+	if (pose > (lua_Integer)l) pose = l;
+	if (posi > pose) return 0;  /* empty interval; return no values */
+	n = (int)(pose - posi + 1);
+	if (posi + n <= pose)  /* arithmetic overflow? */
+		return luaL_error(L, "string slice too long");
+	luaL_checkstack(L, n, "string slice too long");
+	for (i=0; i<n; i++)
+		lua_pushinteger(L, uchar(s[posi+i-1]));
+	return n;
+}
+
+static void code2char (lua_State *L, int idx, char *p, lua_Integer n) {
+	int i;
+	for (i=0; i<n; ++i, ++idx) {
+		lua_Integer c = luaL_checkinteger(L, idx);
+		luaL_argcheck(L, uchar(c) == c, idx, "value out of range");
+		p[i] = uchar(c);
+	}
+}
+
+static const char *lmemfind (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+	if (l2 == 0) return s1;  /* empty strings are everywhere */
+	else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+	else {
+		const char *init;  /* to search for a '*s2' inside 's1' */
+		l2--;  /* 1st char will be checked by 'memchr' */
+		l1 = l1-l2;  /* 's2' cannot be found after that */
+		while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+			init++;   /* 1st char is already checked */
+			if (memcmp(init, s2+1, l2) == 0)
+				return init-1;
+			else {  /* correct 'l1' and 's1' to try again */
+				l1 -= init-s1;
+				s1 = init;
+			}
+		}
+		return NULL;  /* not found */
+	}
+}
+
+/*
+** {======================================================
+** PACK/UNPACK
+** =======================================================
+*/
+
+/* value used for padding */
+#if !defined(LUA_PACKPADBYTE)
+#define LUA_PACKPADBYTE		0x00
+#endif
+
+/* maximum size for the binary representation of an integer */
+#define MAXINTSIZE	16
+
+/* number of bits in a character */
+#define NB	CHAR_BIT
+
+/* mask for one character (NB 1's) */
+#define MC	((1 << NB) - 1)
+
+/* size of a lua_Integer */
+#define SZINT	((int)sizeof(lua_Integer))
+
+/* maximum size of a variable-length integer (7 bits per byte) */
+#define MAXVARINT	((SZINT*NB + 6) / 7)
+
+
+/* dummy union to get native endianness */
+static const union {
+	int dummy;
+	char little;  /* true iff machine is little endian */
+} nativeendian = {1};
+
+
+/* dummy structure to get native alignment requirements */
+struct cD {
+	char c;
+#ifndef _KERNEL
+	union { double d; void *p; lua_Integer i; lua_Number n; } u;
+#else /* _KERNEL */
+	union { void *p; lua_Integer i; lua_Number n; } u;
+#endif /* _KERNEL */
+};
+
+#define MAXALIGN	(offsetof(struct cD, u))
+
+
+#ifndef _KERNEL
+/*
+** Union for serializing floats
+*/
+typedef union Ftypes {
+	float f;
+	double d;
+	lua_Number n;
+	char buff[5 * sizeof(lua_Number)];  /* enough for any float type */
+} Ftypes;
+#endif /* _KERNEL */
+
+
+/*
+** information to pack/unpack stuff
+*/
+typedef struct Header {
+	lua_State *L;
+	int islittle;
+	int maxalign;
+} Header;
+
+
+/*
+** options for pack/unpack
+*/
+typedef enum KOption {
+	Kint,		/* signed integers */
+	Kuint,	/* unsigned integers */
+#ifndef _KERNEL
+	Kfloat,	/* floating-point numbers */
+#endif /* _KERNEL */
+	Kchar,	/* fixed-length strings */
+	Kstring,	/* strings with prefixed length */
+	Kzstr,	/* zero-terminated strings */
+	Kvarint,	/* variable-length integers */
+	Kpadding,	/* padding */
+	Kpaddalign,	/* padding for alignment */
+	Knop		/* no-op (configuration or spaces) */
+} KOption;
+
+
+/*
+** Read an integer numeral from string 'fmt' or return 'df' if
+** there is no numeral
+*/
+static int digit (int c) { return '0' <= c && c <= '9'; }
+
+static int getnum (const char **fmt, int df) {
+	if (!digit(**fmt))  /* no number? */
+		return df;  /* return default value */
+	else {
+		int a = 0;
+		do {
+			a = a*10 + (*((*fmt)++) - '0');
+		} while (digit(**fmt) && a <= ((int)LUAMEM_MAXALLOC - 9)/10);
+		return a;
+	}
+}
+
+
+/*
+** Read an integer numeral and raises an error if it is larger
+** than the maximum size for integers.
+*/
+static int getnumlimit (Header *h, const char **fmt, int df) {
+	int sz = getnum(fmt, df);
+	if (sz > MAXINTSIZE || sz <= 0)
+		luaL_error(h->L, "integral size (%d) out of limits [1,%d]",
+		                 sz, MAXINTSIZE);
+	return sz;
+}
+
+
+/*
+** Initialize Header
+*/
+static void initheader (lua_State *L, Header *h) {
+	h->L = L;
+	h->islittle = nativeendian.little;
+	h->maxalign = 1;
+}
+
+
+/*
+** Read and classify next option. 'size' is filled with option's size.
+*/
+static KOption getoption (Header *h, const char **fmt, int *size) {
+	int opt = *((*fmt)++);
+	*size = 0;  /* default */
+	switch (opt) {
+		case 'b': *size = sizeof(char); return Kint;
+		case 'B': *size = sizeof(char); return Kuint;
+		case 'h': *size = sizeof(short); return Kint;
+		case 'H': *size = sizeof(short); return Kuint;
+		case 'l': *size = sizeof(long); return Kint;
+		case 'L': *size = sizeof(long); return Kuint;
+		case 'j': *size = sizeof(lua_Integer); return Kint;
+		case 'J': *size = sizeof(lua_Integer); return Kuint;
+		case 'T': *size = sizeof(size_t); return Kuint;
+#ifndef _KERNEL
+		case 'f': *size = sizeof(float); return Kfloat;
+		case 'd': *size = sizeof(double); return Kfloat;
+		case 'n': *size = sizeof(lua_Number); return Kfloat;
+#else /* _KERNEL */
+		case 'n': *size = sizeof(lua_Number); return Kint;
+#endif /* _KERNEL */
+		case 'i': *size = getnumlimit(h, fmt, sizeof(int)); return Kint;
+		case 'I': *size = getnumlimit(h, fmt, sizeof(int)); return Kuint;
+		case 's': *size = getnumlimit(h, fmt, sizeof(size_t)); return Kstring;
+		case 'c':
+			*size = getnum(fmt, -1);
+			if (*size == -1)
+				luaL_error(h->L, "missing size for format option 'c'");
+			return Kchar;
+		case 'z': return Kzstr;
+		case 'v': *size = 1; return Kvarint;  /* signed (zig-zag) */
+		case 'V': return Kvarint;
+		case 'x': *size = 1; return Kpadding;
+		case 'X': return Kpaddalign;
+		case ' ': break;
+		case '<': h->islittle = 1; break;
+		case '>': h->islittle = 0; break;
+		case '=': h->islittle = nativeendian.little; break;
+		case '!': h->maxalign = getnumlimit(h, fmt, MAXALIGN); break;
+		default: luaL_error(h->L, "invalid format option '%c'", opt);
+	}
+	return Knop;
+}
+
+
+/*
+** Read, classify, and fill other details about the next option.
+** 'psize' is filled with option's size, 'notoalign' with its
+** alignment requirements.
+** Local variable 'size' gets the size to be aligned. (Kpadal option
+** always gets its full alignment, other options are limited by 
+** the maximum alignment ('maxalign'). Kchar option needs no alignment
+** despite its size.
+*/
+static KOption getdetails (Header *h, size_t totalsize,
+                           const char **fmt, int *psize, int *ntoalign) {
+	KOption opt = getoption(h, fmt, psize);
+	int align = *psize;  /* usually, alignment follows size */
+	if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
+		if (**fmt == '\0' || getoption(h, fmt, &align) == Kchar || align == 0)
+			luaL_argerror(h->L, 1, "invalid next option for option 'X'");
+	}
+	if (align <= 1 || opt == Kchar)  /* need no alignment? */
+		*ntoalign = 0;
+	else {
+		if (align > h->maxalign)  /* enforce maximum alignment */
+			align = h->maxalign;
+		if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
+			luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
+		*ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
+	}
+	return opt;
+}
+
+
+static char *getbytes (char **b, size_t *i, size_t lb, size_t sz) {
+	size_t newtotal = *i+sz;
+	if (newtotal<=lb) {
+		char *res = *b;
+		*b += sz;
+		*i = newtotal;
+		return res;
+	}
+	return NULL;
+}
+
+static int packfailed (lua_State *L, size_t i, size_t arg) {
+	lua_pushboolean(L, 0);
+	lua_replace(L, arg-2);
+	lua_pushinteger(L, i+1);
+	lua_replace(L, arg-1);
+	return 3+lua_gettop(L)-arg;
+}
+
+static int packchar (char **b, size_t *i, size_t lb, const char c) {
+	if (*i<lb) {
+		(void)(*i)++;
+		*((*b)++) = c;
+		return 1;
+	}
+	return 0;
+}
+
+static int packstream (char **b, size_t *i, size_t lb,
+                       const char *s, size_t sl) {
+	if (sl > 0) {  /* avoid 'memcpy' when 's' can be NULL */
+		char *d = getbytes(b, i, lb, sl);
+		if (d == NULL) return 0;
+		memcpy(d, s, sl * sizeof(char));
+	}
+	return 1;
+}
+
+
+/*
+** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
+** The final 'if' handles the case when 'size' is larger than
+** the size of a Lua integer, correcting the extra sign-extension
 ** bytes if necessary (by default they would be zeros).
 */
-static int packint (char **b, size_t *pos, size_t lb,
-                    lua_Unsigned n, int islittle, int size, int neg) {
-	char *buff = getbytes(b, pos, lb, size);
-	if (buff) {
-		int i;
-		buff[islittle ? 0 : size - 1] = (char)(n & MC);  /* first byte */
-		for (i = 1; i < size; i++) {
-			n >>= NB;
-			buff[islittle ? i : size - 1 - i] = (char)(n & MC);
+static int packint (char **b, size_t *pos, size_t lb,
+                    lua_Unsigned n, int islittle, int size, int neg) {
+	char *buff = getbytes(b, pos, lb, size);
+	if (buff) {
+		int i;
+		buff[islittle ? 0 : size - 1] = (char)(n & MC);  /* first byte */
+		for (i = 1; i < size; i++) {
+			n >>= NB;
+			buff[islittle ? i : size - 1 - i] = (char)(n & MC);
+		}
+		if (neg && size > SZINT) {  /* negative number need sign extension? */
+			for (i = SZINT; i < size; i++)  /* correct extra bytes */
+				buff[islittle ? i : size - 1 - i] = (char)MC;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+** Pack integer 'n' as a sequence of 7-bit groups, least significant first,
+** with the high bit of each byte set when more bytes follow (LEB128).
+*/
+static int packvarint (char **b, size_t *pos, size_t lb, lua_Unsigned n) {
+	char buff[MAXVARINT];
+	int size = 0;
+	while (n >= 0x80) {
+		buff[size++] = (char)(n | 0x80);
+		n >>= 7;
+	}
+	buff[size++] = (char)n;
+	return packstream(b, pos, lb, buff, size);
+}
+
+
+#ifndef _KERNEL
+/*
+** Copy 'size' bytes from 'src' to 'dest', correcting endianness if
+** given 'islittle' is different from native endianness.
+*/
+static void copywithendian (volatile char *dest, volatile const char *src,
+                            int size, int islittle) {
+	if (islittle == nativeendian.little) {
+		while (size-- != 0)
+			*(dest++) = *(src++);
+	}
+	else {
+		dest += size - 1;
+		while (size-- != 0)
+			*(dest--) = *(src++);
+	}
+}
+#endif /* _KERNEL */
+
+/*
+** Packs the value at index 'arg' according to option 'opt' of 'size' bytes
+** in buffer '*b' at position '*i' of its 'lb' bytes. Returns 0 if there is
+** not enough space.
+*/
+static int packoption (lua_State *L, Header *h, KOption opt, int size,
+                       int arg, char **b, size_t *i, size_t lb) {
+	switch (opt) {
+		case Kint: {  /* signed integers */
+			lua_Integer n = luaL_checkinteger(L, arg);
+			if (size < SZINT) {  /* need overflow check? */
+				lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+				luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
+			}
+			if (!packint(b, i, lb, (lua_Unsigned)n, h->islittle, size, (n < 0)))
+				return 0;
+			break;
+		}
+		case Kuint: {  /* unsigned integers */
+			lua_Integer n = luaL_checkinteger(L, arg);
+			if (size < SZINT)  /* need overflow check? */
+				luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
+				                 arg, "unsigned overflow");
+			if (!packint(b, i, lb, (lua_Unsigned)n, h->islittle, size, 0))
+				return 0;
+			break;
+		}
+#ifndef _KERNEL
+		case Kfloat: {  /* floating-point options */
+			volatile Ftypes u;
+			lua_Number n;
+			char *data = getbytes(b, i, lb, size);
+			if (!data) return 0;
+			n = luaL_checknumber(L, arg);  /* get argument */
+			if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+			else if (size == sizeof(u.d)) u.d = (double)n;
+			else u.n = n;
+			/* move 'u' to final result, correcting endianness if needed */
+			copywithendian(data, u.buff, size, h->islittle);
+			break;
+		}
+#endif /* _KERNEL */
+		case Kchar: {  /* fixed-size string */
+			size_t len;
+			const char *s = luamem_checkstring(L, arg, &len);
+			luaL_argcheck(L, len == (size_t)size, arg, "wrong length");
+			if (!packstream(b, i, lb, s, size))
+				return 0;
+			break;
+		}
+		case Kstring: {  /* strings with length count */
+			size_t len;
+			const char *s = luamem_checkstring(L, arg, &len);
+			luaL_argcheck(L, size >= (int)sizeof(size_t) ||
+			                 len < ((size_t)1 << (size * NB)),
+			                 arg, "string length does not fit in given size");
+			if (!packint(b, i, lb, (lua_Unsigned)len, h->islittle, size, 0) ||  /* pack length */
+			    !packstream(b, i, lb, s, len))
+				return 0;
+			break;
+		}
+		case Kzstr: {  /* zero-terminated string */
+			size_t len;
+			const char *s = luamem_checkstring(L, arg, &len);
+			luaL_argcheck(L, memchr(s, '\0', len) == NULL, arg,
+			                 "string contains zeros");
+			if (!packstream(b, i, lb, s, len) || !packchar(b, i, lb, '\0'))
+				return 0;
+			break;
+		}
+		case Kvarint: {  /* variable-length integers */
+			lua_Integer n = luaL_checkinteger(L, arg);
+			lua_Unsigned u = (lua_Unsigned)n;
+			if (size) u = (u << 1) ^ (0 - (lua_Unsigned)(n < 0));  /* zig-zag */
+			if (!packvarint(b, i, lb, u))
+				return 0;
+			break;
+		}
+		case Kpadding:
+			return getbytes(b, i, lb, 1) != NULL;
+		case Kpaddalign: case Knop:
+			break;
+	}
+	return 1;
+}
+
+/*
+** Packs the values from index '*parg'+1 in 'mem' from position '*pi'
+** according to format '*fmt' up to the first option that does not fit in
+** the 'lb' bytes of 'mem'. Returns 0 in that case, with '*pi' and '*parg'
+** at the point of failure, '*fmt' at the option that failed and '*start'
+** at the position where it was packed from. Otherwise returns 1.
+*/
+static int packvalues (lua_State *L, Header *h, const char **fmt, int *parg,
+                       char *mem, size_t *pi, size_t *start, size_t lb) {
+	size_t i = *pi;
+	int arg = *parg;
+	mem += i;
+	while (**fmt != '\0') {
+		int size, ntoalign;
+		const char *option = *fmt;
+		KOption opt = getdetails(h, i, fmt, &size, &ntoalign);
+		*start = i;
+		arg++;
+		if (!getbytes(&mem, &i, lb, ntoalign) ||  /* skip alignment */
+		    !packoption(L, h, opt, size, arg, &mem, &i, lb)) {
+			*fmt = option;
+			*pi = i;
+			*parg = arg;
+			return 0;
+		}
+		if (opt == Kpadding || opt == Kpaddalign || opt == Knop)
+			arg--;  /* undo increment */
+	}
+	*pi = i;
+	*parg = arg;
+	return 1;
+}
+
+static int mem_pack (lua_State *L) {
+	Header h;
+	size_t i, start, lb;
+	char *mem = luamem_checkmemory(L, 1, &lb);
+	const char *fmt = luaL_checkstring(L, 2);  /* format string */
+	lua_Integer pos = posrelat(luaL_checkinteger(L, 3), lb)-1;
+	int arg = 3;  /* current argument to pack */
+	luaL_argcheck(L, 0 <= pos && pos <= (lua_Integer)lb, 3,
+		"index out of bounds");
+	initheader(L, &h);
+	i = (size_t)pos;
+	if (!packvalues(L, &h, &fmt, &arg, mem, &i, &start, lb))
+		return packfailed(L, i, arg);
+	lua_pushboolean(L, 1);
+	lua_pushinteger(L, i+1);
+	return 2;
+}
+
+/*
+** Values that do not fit in 'm' are packed in a buffer that grows
+** geometrically, and 'm' is resized only once all values are packed, so
+** errors leave it unchanged and values read from 'm' itself keep its
+** previous contents.
+*/
+static int mem_packappend (lua_State *L) {
+	Header h;
+	size_t lb, lbuf, i, start;
+	luamem_Unref unref;
+	char *mem = luamem_tomemoryx(L, 1, &lb, &unref, NULL);
+	char *buf = mem;  /* where values are packed */
+	const char *fmt = luaL_checkstring(L, 2);  /* format string */
+	int arg = 2;  /* current argument to pack */
+	luaL_argcheck(L, unref == luamem_free, 1, "resizable memory expected");
+	initheader(L, &h);
+	i = lbuf = lb;
+	while (!packvalues(L, &h, &fmt, &arg, buf, &i, &start, lbuf)) {
+		size_t size = lbuf < 64 ? 128 : lbuf*2;  /* reserve geometrically */
+		char *grown;
+		luaL_argcheck(L, lbuf < LUAMEM_MAXALLOC, 1, "memory too large");
+		if (size > LUAMEM_MAXALLOC || size < lbuf) size = LUAMEM_MAXALLOC;
+		if (buf == mem) lua_pushnil(L);  /* mark to separate arguments from buffer */
+		grown = (char *)lua_newuserdata(L, size);
+		if (start > 0) memcpy(grown, buf, start);
+		memsetpar(grown+start, 0, size-start);  /* padding is not written */
+		if (buf != mem) lua_remove(L, -2);  /* previous buffer is garbage now */
+		buf = grown;
+		lbuf = size;
+		i = start;  /* retry the option that did not fit */
+		arg--;
+	}
+	if (i != lb) {  /* move packed values to the memory */
+		mem = resizemem(L, 1, mem, lb, i);
+		memcpy(mem+lb, buf+lb, i-lb);
+	}
+	lua_pushinteger(L, i+1);
+	return 1;
+}
+
+
+/*
+** Unpack an integer with 'size' bytes and 'islittle' endianness.
+** If size is smaller than the size of a Lua integer and integer
+** is signed, must do sign extension (propagating the sign to the
+** higher bits); if size is larger than the size of a Lua integer,
+** it must check the unread bytes to see whether they do not cause an
+** overflow.
+*/
+static lua_Integer unpackint (lua_State *L, const char *str,
+                              int islittle, int size, int issigned) {
+	lua_Unsigned res = 0;
+	int i;
+	int limit = (size  <= SZINT) ? size : SZINT;
+	for (i = limit - 1; i >= 0; i--) {
+		res <<= NB;
+		res |= (lua_Unsigned)uchar(str[islittle ? i : size - 1 - i]);
+	}
+	if (size < SZINT) {  /* real size smaller than lua_Integer? */
+		if (issigned) {  /* needs sign extension? */
+			lua_Unsigned mask = (lua_Unsigned)1 << (size*NB - 1);
+			res = ((res ^ mask) - mask);  /* do sign extension */
 		}
-		if (neg && size > SZINT) {  /* negative number need sign extension? */
-			for (i = SZINT; i < size; i++)  /* correct extra bytes */
-				buff[islittle ? i : size - 1 - i] = (char)MC;
+	}
+	else if (size > SZINT) {  /* must check unread bytes */
+		int mask = (!issigned || (lua_Integer)res >= 0) ? 0 : MC;
+		for (i = limit; i < size; i++) {
+			if (uchar(str[islittle ? i : size - 1 - i]) != mask)
+				luaL_error(L, "%d-byte integer does not fit into Lua Integer", size);
+		}
+	}
+	return (lua_Integer)res;
+}
+
+
+/*
+** Unpack a variable-length integer from the 'len' bytes of 'str' into
+** 'res'. Returns the number of bytes read, 0 if the data ends before the
+** last byte of the integer, or -1 if it does not fit into a Lua Integer.
+** Integers of up to 8 bytes are gathered from a single word whose 7-bit
+** groups are merged pairwise, with no branch per byte.
+*/
+static int unpackvarint (const char *str, size_t len, lua_Unsigned *res) {
+	lua_Unsigned n = 0;
+	int i, shift;
+	if (len >= 8 && sizeof(unsigned long long) == 8) {
+		unsigned long long w, stop;
+		memcpy(&w, str, 8);
+		if (!nativeendian.little) w = bswap64(w);
+		stop = ~w & 0x8080808080808080ULL;  /* bytes ending the integer */
+		if (stop != 0) {
+			int bits = __builtin_ctzll(stop) + 1;  /* bits of integer bytes */
+			if (bits < 64) w &= (1ULL << bits) - 1;
+			w &= 0x7f7f7f7f7f7f7f7fULL;
+			w = (w & 0x007f007f007f007fULL) | ((w & 0x7f007f007f007f00ULL) >> 1);
+			w = (w & 0x00003fff00003fffULL) | ((w & 0x3fff00003fff0000ULL) >> 2);
+			w = (w & 0x000000000fffffffULL) | ((w & 0x0fffffff00000000ULL) >> 4);
+			if (SZINT*NB < 56 && (w >> (SZINT*NB % 64)) != 0) return -1;
+			*res = (lua_Unsigned)w;
+			return bits / 8;
+		}
+	}
+	for (i = 0, shift = 0; i < MAXVARINT; i++, shift += 7) {
+		lua_Unsigned b;
+		if ((size_t)i >= len) return 0;
+		b = (lua_Unsigned)(uchar(str[i]) & 0x7f);
+		if (shift > 0 && (b >> (SZINT*NB - shift)) != 0) return -1;
+		n |= b << shift;
+		if (!(uchar(str[i]) & 0x80)) {
+			*res = n;
+			return i + 1;
+		}
+	}
+	return (size_t)i < len ? -1 : 0;
+}
+
+static int mem_unpack (lua_State *L) {
+	Header h;
+	size_t ld;
+	const char *data = luamem_checkmemory(L, 1, &ld);
+	const char *fmt = luaL_checkstring(L, 2);
+	size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
+	int n = 0;  /* number of results */
+	luaL_argcheck(L, pos <= ld, 3, "initial position out of bounds");
+	initheader(L, &h);
+	while (*fmt != '\0') {
+		int size, ntoalign;
+		KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
+		if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
+			luaL_argerror(L, 1, "data too short");
+		pos += ntoalign;  /* skip alignment */
+		/* stack space for item + next position */
+		luaL_checkstack(L, 1, "too many results");
+		n++;
+		switch (opt) {
+			case Kint:
+			case Kuint: {
+				lua_Integer res = unpackint(L, data + pos, h.islittle, size,
+				                               (opt == Kint));
+				lua_pushinteger(L, res);
+				break;
+			}
+#ifndef _KERNEL
+			case Kfloat: {
+				volatile Ftypes u;
+				lua_Number num;
+				copywithendian(u.buff, data + pos, size, h.islittle);
+				if (size == sizeof(u.f)) num = (lua_Number)u.f;
+				else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+				else num = u.n;
+				lua_pushnumber(L, num);
+				break;
+			}
+#endif /* _KERNEL */
+			case Kchar: {
+				lua_pushlstring(L, data + pos, size);
+				break;
+			}
+			case Kstring: {
+				size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
+				luaL_argcheck(L, pos + len + size <= ld, 2, "data string too short");
+				lua_pushlstring(L, data + pos + size, len);
+				pos += len;  /* skip string */
+				break;
+			}
+			case Kzstr: {
+				size_t len;
+				const char *z = (const char *)memchr(data + pos, '\0', ld - pos);
+				luaL_argcheck(L, z, 2, "data string too short");
+				len = (size_t)(z - data - pos);
+				lua_pushlstring(L, data + pos, len);
+				pos += len + 1;  /* skip string plus final '\0' */
+				break;
+			}
+			case Kvarint: {
+				lua_Unsigned u = 0;
+				int len = unpackvarint(data + pos, ld - pos, &u);
+				if (len == 0) luaL_argerror(L, 1, "data too short");
+				if (len < 0) luaL_error(L, "variable-length integer does not fit into Lua Integer");
+				if (size) u = (u >> 1) ^ (0 - (u & 1));  /* zig-zag */
+				lua_pushinteger(L, (lua_Integer)u);
+				pos += len;
+				size = 0;
+				break;
+			}
+			case Kpaddalign: case Kpadding: case Knop:
+				n--;  /* undo increment */
+				break;
+		}
+		pos += size;
+	}
+	lua_pushinteger(L, pos + 1);  /* next position */
+	return n + 1;
+}
+
+
+/*
+** Read the format of an element for 'convert', which is a single numeric
+** option possibly preceded by endianness options.
+*/
+static KOption getelement (lua_State *L, Header *h, int arg, int *size) {
+	const char *fmt = luaL_checkstring(L, arg);
+	KOption opt;
+	initheader(L, h);
+	do opt = getoption(h, &fmt, size);
+	while (opt == Knop && *fmt != '\0');
+	luaL_argcheck(L, *fmt == '\0' && (opt == Kint || opt == Kuint
+#ifndef _KERNEL
+	                                  || opt == Kfloat
+#endif /* _KERNEL */
+	                                  ), arg, "invalid element format");
+	return opt;
+}
+
+static int mem_convert (lua_State *L) {
+	Header dh, sh;
+	size_t ld, ls, di, si, count, i;
+	int dsize, ssize;
+	char *dst;
+	const char *src;
+	KOption dopt = getelement(L, &dh, 2, &dsize);
+	KOption sopt = getelement(L, &sh, 4, &ssize);
+	lua_Integer pos;
+	luamem_checkstring(L, 3, &ls);
+	pos = posrelat(luaL_optinteger(L, 7, 1), ls);
+	luaL_argcheck(L, 1 <= pos && pos <= (lua_Integer)ls+1, 7, "index out of bounds");
+	si = (size_t)pos-1;
+	count = (ls-si)/ssize;
+	if (!lua_isnoneornil(L, 5)) {
+		size_t n = luamem_checklenarg(L, 5);
+		luaL_argcheck(L, n <= count, 5, "data too short");
+		count = n;
+	}
+	luaL_argcheck(L, count <= LUAMEM_MAXALLOC/dsize, 5, "too many elements");
+	dst = luamem_checkmemory(L, 1, &ld);
+	pos = posrelat(luaL_optinteger(L, 6, 1), ld);
+	luaL_argcheck(L, 1 <= pos && pos <= (lua_Integer)ld+1, 6, "index out of bounds");
+	di = (size_t)pos-1;
+	dst = checkroom(L, 1, dst, &ld, di, count*dsize) + di;
+	src = luamem_checkstring(L, 3, &ls) + si;  /* 'dst' might be 'src' moved */
+	if (!(dopt == sopt && dsize == ssize) &&
+	    src < dst + count*dsize && dst < src + count*ssize) {  /* overlap? */
+		char *copy = (char *)lua_newuserdata(L, count*ssize);
+		memcpy(copy, src, count*ssize);
+		src = copy;
+	}
+	if (dopt == sopt && dsize == ssize) {  /* only byte order may change */
+		memmove(dst, src, count*dsize);
+		if (dh.islittle != sh.islittle) byteswap(dst, count, dsize);
+	}
+	else for (i = 0; i < count; i++, src += ssize, dst += dsize) {
+		lua_Integer n = 0;
+		size_t k = 0;
+#ifndef _KERNEL
+		lua_Number f = 0;
+		if (sopt == Kfloat) {
+			volatile Ftypes u;
+			copywithendian(u.buff, src, ssize, sh.islittle);
+			if (ssize == sizeof(u.f)) f = (lua_Number)u.f;
+			else if (ssize == sizeof(u.d)) f = (lua_Number)u.d;
+			else f = u.n;
+			if (dopt != Kfloat && (!lua_numbertointeger(f, &n) || (lua_Number)n != f))
+				return luaL_error(L, "number has no integer representation");
+		}
+		else
+#endif /* _KERNEL */
+		{
+			n = unpackint(L, src, sh.islittle, ssize, (sopt == Kint));
+#ifndef _KERNEL
+			f = (lua_Number)n;
+#endif /* _KERNEL */
+		}
+		switch (dopt) {
+			case Kint: {
+				char *b = dst;
+				if (dsize < SZINT) {  /* need overflow check? */
+					lua_Integer lim = (lua_Integer)1 << ((dsize * NB) - 1);
+					if (!(-lim <= n && n < lim))
+						return luaL_error(L, "integer overflow");
+				}
+				packint(&b, &k, dsize, (lua_Unsigned)n, dh.islittle, dsize, (n < 0));
+				break;
+			}
+			case Kuint: {
+				char *b = dst;
+				if (dsize < SZINT &&
+				    (lua_Unsigned)n >= ((lua_Unsigned)1 << (dsize * NB)))
+					return luaL_error(L, "unsigned overflow");
+				packint(&b, &k, dsize, (lua_Unsigned)n, dh.islittle, dsize, 0);
+				break;
+			}
+#ifndef _KERNEL
+			case Kfloat: {
+				volatile Ftypes u;
+				if (dsize == sizeof(u.f)) u.f = (float)f;
+				else if (dsize == sizeof(u.d)) u.d = (double)f;
+				else u.n = f;
+				copywithendian(dst, u.buff, dsize, dh.islittle);
+				break;
+			}
+#endif /* _KERNEL */
+			default: break;
+		}
+	}
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** SORTING
+** =======================================================
+*/
+
+/*
+** Key of fixed-size records, whose bytes are compared as unsigned digits
+** from the most significant one. Signed integers have the sign bit of the
+** most significant byte flipped, and floating-point numbers also have the
+** remaining bits flipped when negative.
+*/
+typedef struct SortKey {
+	size_t offset;  /* offset of the key in the record */
+	int size;
+	int islittle;
+	KOption opt;
+} SortKey;
+
+static int keydigit (const SortKey *k, const unsigned char *p, int d) {
+	int c = p[k->islittle ? k->size - 1 - d : d];
+	if (k->opt == Kint && d == 0) c ^= 0x80;
+#ifndef _KERNEL
+	else if (k->opt == Kfloat) {
+		if (p[k->islittle ? k->size - 1 : 0] & 0x80) c ^= 0xff;
+		else if (d == 0) c ^= 0x80;
+	}
+#endif /* _KERNEL */
+	return c;
+}
+
+static int keycmp (const SortKey *k, const unsigned char *p1,
+                   const unsigned char *p2) {
+	int d;
+	for (d = 0; d < k->size; d++) {
+		int c = keydigit(k, p1, d) - keydigit(k, p2, d);
+		if (c) return c;
+	}
+	return 0;
+}
+
+/*
+** Read the record size, key offset and key format in arguments 2 to 4
+** and the range of records in arguments 'arg' and 'arg+1' of the 'len'
+** bytes of the memory. Returns the number of records and sets '*start'
+** to the offset of the first one.
+*/
+static size_t checkrecords (lua_State *L, SortKey *k, size_t *recsize,
+                            size_t len, int arg, size_t *start) {
+	Header h;
+	const char *fmt = luaL_checkstring(L, 4);
+	lua_Integer offset = luaL_checkinteger(L, 3);
+	lua_Integer posi = posrelat(luaL_optinteger(L, arg, 1), len);
+	lua_Integer pose = posrelat(luaL_optinteger(L, arg+1, -1), len);
+	*recsize = luamem_checklenarg(L, 2);
+	luaL_argcheck(L, *recsize > 0, 2, "invalid record size");
+	initheader(L, &h);
+	do k->opt = getoption(&h, &fmt, &k->size);
+	while (k->opt == Knop && *fmt != '\0');
+	luaL_argcheck(L, *fmt == '\0' && (k->opt == Kint || k->opt == Kuint ||
+#ifndef _KERNEL
+	                                  k->opt == Kfloat ||
+#endif /* _KERNEL */
+	                                  k->opt == Kchar), 4, "invalid key format");
+	luaL_argcheck(L, k->size > 0 &&
+	                 (size_t)k->size <= LUAMEM_MAXALLOC/(256*sizeof(size_t)),
+	                 4, "invalid key format");
+	luaL_argcheck(L, 0 <= offset && (size_t)offset <= *recsize &&
+	                 (size_t)k->size <= *recsize - (size_t)offset,
+	                 3, "key out of record");
+	k->offset = (size_t)offset;
+	k->islittle = k->opt != Kchar && h.islittle;
+	if (posi < 1) posi = 1;
+	if (pose > (lua_Integer)len) pose = len;
+	*start = (size_t)posi - 1;
+	if (posi > pose) return 0;
+	luaL_argcheck(L, ((size_t)(pose - posi) + 1) % *recsize == 0, arg+1,
+	                 "range is not a multiple of record size");
+	return ((size_t)(pose - posi) + 1) / *recsize;
+}
+
+/*
+** Stable LSD radix sort: the histograms of all digits are computed in a
+** single pass, and then the records are moved between the memory and a
+** scratch buffer once for each digit that is not the same in all of them.
+*/
+static int mem_sort (lua_State *L) {
+	SortKey k;
+	size_t len, recsize, start, n, i, *counts;
+	char *mem = luamem_checkmemory(L, 1, &len), *src, *dst, *scratch = NULL;
+	int d;
+	n = checkrecords(L, &k, &recsize, len, 5, &start);
+	if (n < 2) return 0;
+	counts = (size_t *)lua_newuserdata(L, 256*sizeof(size_t)*k.size);
+	memset(counts, 0, 256*sizeof(size_t)*k.size);
+	src = mem + start;
+	for (i = 0; i < n; i++) {
+		const unsigned char *p = (unsigned char *)src + i*recsize + k.offset;
+		for (d = 0; d < k.size; d++) counts[d*256 + keydigit(&k, p, d)]++;
+	}
+	for (d = k.size - 1; d >= 0; d--) {
+		size_t *pos = counts + d*256, total = 0;
+		const char *p;
+		int c;
+		for (c = 0; c < 256 && pos[c] != n; c++) {
+			size_t count = pos[c];
+			pos[c] = total;
+			total += count;
 		}
+		if (c < 256) continue;  /* digit is the same in all records */
+		if (scratch == NULL) scratch = (char *)lua_newuserdata(L, n*recsize);
+		dst = src == mem + start ? scratch : mem + start;
+		for (i = 0, p = src; i < n; i++, p += recsize) {
+			c = keydigit(&k, (const unsigned char *)p + k.offset, d);
+			memcpy(dst + (pos[c]++)*recsize, p, recsize);
+		}
+		src = dst;
+	}
+	if (src != mem + start) memcpy(mem + start, src, n*recsize);
+	return 0;
+}
+
+/*
+** Binary search for the first record with a key that is not less than
+** the given one.
+*/
+static int mem_bsearch (lua_State *L) {
+	SortKey k;
+	size_t len, recsize, start, n, lo, hi;
+	const char *mem = luamem_checkstring(L, 1, &len);
+	const unsigned char *key;
+	char buff[MAXINTSIZE];
+	n = checkrecords(L, &k, &recsize, len, 6, &start);
+	if (k.opt == Kchar) {
+		size_t l;
+		key = (const unsigned char *)luamem_checkstring(L, 5, &l);
+		luaL_argcheck(L, l == (size_t)k.size, 5, "wrong length");
+	}
+	else {
+		Header h;
+		char *b = buff;
+		size_t i = 0;
+		h.L = L;
+		h.islittle = k.islittle;
+		h.maxalign = 1;
+		packoption(L, &h, k.opt, k.size, 5, &b, &i, sizeof(buff));
+		key = (const unsigned char *)buff;
+	}
+	mem += start;
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		if (keycmp(&k, (const unsigned char *)mem + mid*recsize + k.offset,
+		           key) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < n && keycmp(&k, (const unsigned char *)mem + lo*recsize + k.offset,
+	                     key) == 0) {
+		lua_pushinteger(L, (lua_Integer)(start + lo*recsize) + 1);
 		return 1;
 	}
-	return 0;
+	lua_pushnil(L);
+	lua_pushinteger(L, (lua_Integer)(start + lo*recsize) + 1);
+	return 2;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** SERIALIZATION
+** =======================================================
+*/
+
+/*
+** Values are encoded in the MessagePack format. Strings are encoded as
+** 'str', memories as 'bin', and tables as 'array' when their keys are
+** exactly 1 to their length (and the length is not zero), or as 'map'
+** otherwise. When a table of previous strings is used, strings with at
+** least LUAMEM_DEDUPMIN bytes are numbered by the order they first
+** appear, and repeated ones are encoded as an extension of type
+** LUAMEM_DEDUPEXT with their number.
+*/
+
+#if !defined(LUAMEM_MAXDEPTH)
+#define LUAMEM_MAXDEPTH	200  /* maximum nesting of tables */
+#endif
+
+#if !defined(LUAMEM_DEDUPMIN)
+#define LUAMEM_DEDUPMIN	4
+#endif
+
+#if !defined(LUAMEM_DEDUPEXT)
+#define LUAMEM_DEDUPEXT	127
+#endif
+
+typedef struct Encoder {
+	lua_State *L;
+	char *mem;  /* where the byte at position 'base' is written */
+	size_t base;  /* position of first byte encoded */
+	size_t len;  /* size of the memory or the buffer */
+	size_t pos;  /* position of next byte */
+	size_t end;  /* original size of the memory */
+	int resizable;
+	int buffered;  /* bytes are written to a buffer instead of the memory */
+	int dedup;  /* index of table of previous strings, or 0 */
+	lua_Integer ndedup;  /* number of strings in it when the call began */
+	lua_Integer nadded;  /* number of strings numbered since then */
+} Encoder;
+
+typedef struct Decoder {
+	lua_State *L;
+	const char *s;
+	size_t len;
+	size_t pos;  /* position of next byte */
+	int dedup;  /* index of table of previous strings, or 0 */
+	lua_Integer ndedup;  /* number of strings in it when the call began */
+	lua_Integer nadded;  /* number of strings numbered since then */
+} Decoder;
+
+/*
+** Strings numbered during a call are kept in a table right after the one
+** of previous strings ('dedup'+1), which is merged into it only when the
+** call succeeds, so errors leave the table of previous strings unchanged.
+*/
+static void dedupadd (lua_State *L, int dedup, lua_Integer n, int idx) {
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, dedup+1, n);
+	lua_pushvalue(L, idx);
+	lua_pushinteger(L, n);
+	lua_rawset(L, dedup+1);
+}
+
+static void dedupmerge (lua_State *L, int dedup, lua_Integer first,
+                                                 lua_Integer last) {
+	lua_Integer n;
+	for (n = first; n <= last; n++) {
+		lua_rawgeti(L, dedup+1, n);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, dedup, n);
+		lua_pushinteger(L, n);
+		lua_rawset(L, dedup);
+	}
+}
+
+/*
+** Returns room for 'n' bytes at the current position. When a resizable
+** memory is too small, the bytes are moved to a buffer (kept at stack
+** index 6) that grows geometrically, and only copied back to the memory
+** once the whole value is encoded, so errors leave its size unchanged.
+*/
+static char *encreserve (Encoder *e, size_t n) {
+	if (n > e->len - e->pos) {
+		size_t size = e->len < 64 ? 128 : e->len*2;
+		char *buf;
+		luaL_argcheck(e->L, e->resizable, 1, "memory too small");
+		luaL_argcheck(e->L, n <= LUAMEM_MAXALLOC - e->pos, 1, "memory too large");
+		if (size > LUAMEM_MAXALLOC || size < e->len) size = LUAMEM_MAXALLOC;
+		if (size < e->pos + n) size = e->pos + n;
+		buf = (char *)lua_newuserdata(e->L, size - e->base);
+		if (e->pos > e->base)  /* 'e->mem' might be NULL otherwise */
+			memcpy(buf, e->mem, e->pos - e->base);
+		lua_replace(e->L, 6);  /* previous buffer is garbage now */
+		e->mem = buf;
+		e->len = size;
+		e->buffered = 1;
+	}
+	e->pos += n;
+	return e->mem + (e->pos - e->base) - n;
+}
+
+/* writes byte 'c' followed by 'n' bytes of 'v' in big-endian order */
+static void encheader (Encoder *e, int c, lua_Unsigned v, int n) {
+	char *p = encreserve(e, 1 + n);
+	*p = (char)c;
+	for (; n > 0; n--, v >>= 8) p[n] = (char)(v & 0xff);
 }
 
+static void encint (Encoder *e, lua_Integer i) {
+	if (0 <= i) {
+		if (i < 0x80) encheader(e, (int)i, 0, 0);  /* positive fixint */
+		else if (i <= 0xff) encheader(e, 0xcc, (lua_Unsigned)i, 1);
+		else if (i <= 0xffff) encheader(e, 0xcd, (lua_Unsigned)i, 2);
+		else if (i <= 0xffffffff) encheader(e, 0xce, (lua_Unsigned)i, 4);
+		else encheader(e, 0xcf, (lua_Unsigned)i, 8);
+	}
+	else if (i >= -32) encheader(e, (int)(i & 0xff), 0, 0);  /* negative fixint */
+	else if (i >= -0x80) encheader(e, 0xd0, (lua_Unsigned)i, 1);
+	else if (i >= -0x8000) encheader(e, 0xd1, (lua_Unsigned)i, 2);
+	else if (i >= -(lua_Integer)0x80000000) encheader(e, 0xd2, (lua_Unsigned)i, 4);
+	else encheader(e, 0xd3, (lua_Unsigned)i, 8);
+}
 
 #ifndef _KERNEL
+static void encfloat (Encoder *e, lua_Number n) {
+	float f = (float)n;
+	if ((lua_Number)f == n) {  /* no precision loss? */
+		unsigned int u;
+		memcpy(&u, &f, sizeof(u));
+		encheader(e, 0xca, u, 4);
+	}
+	else {
+		double d = (double)n;
+		unsigned long long u;
+		memcpy(&u, &d, sizeof(u));
+		encheader(e, 0xcb, (lua_Unsigned)u, 8);
+	}
+}
+#endif /* _KERNEL */
+
 /*
-** Copy 'size' bytes from 'src' to 'dest', correcting endianness if
-** given 'islittle' is different from native endianness.
+** Writes a header with one of the codes in 'c' for a fixed size and 8, 16
+** or 32-bit sizes, where 'max' is the maximum fixed size.
 */
-static void copywithendian (volatile char *dest, volatile const char *src,
-                            int size, int islittle) {
-	if (islittle == nativeendian.little) {
-		while (size-- != 0)
-			*(dest++) = *(src++);
+static void encsize (Encoder *e, size_t n, const int c[4], size_t max) {
+	if (n <= max) encheader(e, c[0] | (int)n, 0, 0);
+	else if (c[1] && n <= 0xff) encheader(e, c[1], n, 1);
+	else if (n <= 0xffff) encheader(e, c[2], n, 2);
+	else {
+		luaL_argcheck(e->L, n <= 0xffffffff, 3, "value too large");
+		encheader(e, c[3], n, 4);
+	}
+}
+
+/* writes the string or memory at index 'idx' with a header of 'encsize' */
+static void encbytes (Encoder *e, int idx, const int c[4], size_t max) {
+	size_t l;
+	char *p;
+	luamem_tostring(e->L, idx, &l);
+	encsize(e, l, c, max);
+	p = encreserve(e, l);
+	memcpy(p, luamem_tostring(e->L, idx, NULL), l);
+}
+
+static void encstring (Encoder *e, int idx) {
+	static const int str[] = {0xa0, 0xd9, 0xda, 0xdb};
+	size_t l;
+	lua_tolstring(e->L, idx, &l);
+	if (e->dedup && l >= LUAMEM_DEDUPMIN) {
+		lua_State *L = e->L;
+		lua_Integer n;
+		lua_pushvalue(L, idx);
+		if (lua_rawget(L, e->dedup) == LUA_TNIL) {
+			lua_pushvalue(L, idx);
+			lua_rawget(L, e->dedup+1);
+			lua_remove(L, -2);
+		}
+		n = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (n > 0) {  /* previous string? */
+			if (n <= 0xff) encheader(e, 0xd4, LUAMEM_DEDUPEXT << 8 | n, 2);
+			else if (n <= 0xffff) encheader(e, 0xd5, LUAMEM_DEDUPEXT << 16 | n, 3);
+			else encheader(e, 0xd6, (lua_Unsigned)LUAMEM_DEDUPEXT << 32 | n, 5);
+			return;
+		}
+		dedupadd(L, e->dedup, e->ndedup + ++e->nadded, idx);
+	}
+	encbytes(e, idx, str, 31);
+}
+
+static void encvalue (Encoder *e, int idx, int depth);
+
+static void enctable (Encoder *e, int idx, int depth) {
+	static const int array[] = {0x90, 0, 0xdc, 0xdd};
+	static const int map[] = {0x80, 0, 0xde, 0xdf};
+	lua_State *L = e->L;
+	size_t n = (size_t)lua_rawlen(L, idx), count = 0;
+	int isarray = n > 0;
+	if (depth > LUAMEM_MAXDEPTH) luaL_error(L, "table too deep");
+	luaL_checkstack(L, 3, "table too deep");
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		count++;
+		if (isarray) {  /* keys are only 1 to 'n' so far? */
+			lua_Integer k = lua_tointeger(L, -2);
+			isarray = lua_isinteger(L, -2) && 1 <= k && (lua_Unsigned)k <= n;
+		}
+		lua_pop(L, 1);
+	}
+	if (isarray && count == n) {
+		size_t i;
+		encsize(e, n, array, 15);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, idx, (lua_Integer)i);
+			encvalue(e, lua_gettop(L), depth);
+			lua_pop(L, 1);
+		}
 	}
 	else {
-		dest += size - 1;
-		while (size-- != 0)
-			*(dest--) = *(src++);
+		encsize(e, count, map, 15);
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			encvalue(e, lua_gettop(L) - 1, depth);
+			encvalue(e, lua_gettop(L), depth);
+			lua_pop(L, 1);
+		}
 	}
 }
+
+static void encvalue (Encoder *e, int idx, int depth) {
+	static const int bin[] = {0, 0xc4, 0xc5, 0xc6};
+	lua_State *L = e->L;
+	switch (lua_type(L, idx)) {
+		case LUA_TNIL: encheader(e, 0xc0, 0, 0); break;
+		case LUA_TBOOLEAN: encheader(e, lua_toboolean(L, idx) ? 0xc3 : 0xc2, 0, 0); break;
+		case LUA_TNUMBER:
+#ifndef _KERNEL
+			if (!lua_isinteger(L, idx)) encfloat(e, lua_tonumber(L, idx));
+			else
 #endif /* _KERNEL */
+			encint(e, lua_tointeger(L, idx));
+			break;
+		case LUA_TSTRING: encstring(e, idx); break;
+		case LUA_TTABLE: enctable(e, idx, depth + 1); break;
+		default: {
+			if (luamem_tomemory(L, idx, NULL) == NULL)
+				luaL_error(L, "cannot encode a %s value", luaL_typename(L, idx));
+			encbytes(e, idx, bin, 0);
+		}
+	}
+}
 
-static int mem_pack (lua_State *L) {
-	Header h;
-	size_t i, lb;
-	char *mem = luamem_checkmemory(L, 1, &lb);
-	const char *fmt = luaL_checkstring(L, 2);  /* format string */
-	lua_Integer pos = posrelat(luaL_checkinteger(L, 3), lb)-1;
-	int arg = 3;  /* current argument to pack */
-	luaL_argcheck(L, 0 <= pos && pos <= (lua_Integer)lb, 3,
-		"index out of bounds");
-	initheader(L, &h);
-	i = (size_t)pos;
-	mem += i;
-	while (*fmt != '\0') {
-		int size, ntoalign;
-		KOption opt = getdetails(&h, i, &fmt, &size, &ntoalign);
-		arg++;
-		if (!getbytes(&mem, &i, lb, ntoalign))  /* skip alignment */
-			return packfailed(L, i, arg);
-		switch (opt) {
-			case Kint: {  /* signed integers */
-				lua_Integer n = luaL_checkinteger(L, arg);
-				if (size < SZINT) {  /* need overflow check? */
-					lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-					luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-				}
-				if (!packint(&mem, &i, lb, (lua_Unsigned)n, h.islittle, size, (n < 0)))
-					return packfailed(L, i, arg);
-				break;
-			}
-			case Kuint: {  /* unsigned integers */
-				lua_Integer n = luaL_checkinteger(L, arg);
-				if (size < SZINT)  /* need overflow check? */
-					luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-					                 arg, "unsigned overflow");
-				if (!packint(&mem, &i, lb, (lua_Unsigned)n, h.islittle, size, 0))
-					return packfailed(L, i, arg);
-				break;
-			}
+static int mem_encode (lua_State *L) {
+	Encoder e;
+	luamem_Unref unref;
+	char *mem;
+	e.L = L;
+	mem = checkoutput(L, 1, &e.len, &e.pos);
+	e.mem = mem + e.pos;
+	e.base = e.pos;
+	e.end = e.len;
+	e.buffered = 0;
+	luamem_tomemoryx(L, 1, NULL, &unref, NULL);
+	e.resizable = unref == luamem_free;
+	luaL_checkany(L, 3);
+	if (lua_isnoneornil(L, 4)) e.dedup = 0;
+	else {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		e.dedup = 4;
+		e.ndedup = (lua_Integer)lua_rawlen(L, 4);
+		e.nadded = 0;
+	}
+	lua_settop(L, 4);
+	lua_newtable(L);  /* strings numbered by this call */
+	lua_pushnil(L);  /* room for the buffer */
+	encvalue(&e, 3, 0);
+	if (e.buffered) {  /* move encoded bytes to the memory */
+		mem = resizemem(L, 1, mem, e.end, e.pos);
+		memcpy(mem + e.base, e.mem, e.pos - e.base);
+	}
+	if (e.dedup) dedupmerge(L, 4, e.ndedup + 1, e.ndedup + e.nadded);
+	lua_pushinteger(L, (lua_Integer)e.pos + 1);
+	return 1;
+}
+
+static void decerror (Decoder *d, const char *msg) {
+	luaL_error(d->L, "%s at position %d", msg, (int)d->pos + 1);
+}
+
+static const unsigned char *decbytes (Decoder *d, size_t n) {
+	if (n > d->len - d->pos) decerror(d, "data too short");
+	d->pos += n;
+	return (const unsigned char *)d->s + d->pos - n;
+}
+
+/* reads 'n' bytes as a big-endian unsigned integer */
+static lua_Unsigned decuint (Decoder *d, int n) {
+	const unsigned char *p = decbytes(d, n);
+	lua_Unsigned v = 0;
+	int i;
+	for (i = 0; i < n; i++) v = (v << 8) | p[i];
+	return v;
+}
+
+/* reads 'n' bytes as a big-endian signed integer */
+static lua_Integer decint (Decoder *d, int n) {
+	lua_Unsigned v = decuint(d, n), mask = (lua_Unsigned)1 << (n*8 - 1);
+	return (lua_Integer)((v ^ mask) - mask);  /* sign extension */
+}
+
+static void decstring (Decoder *d, size_t n) {
+	lua_State *L = d->L;
+	const char *s = (const char *)decbytes(d, n);
+	lua_pushlstring(L, s, n);
+	if (d->dedup && n >= LUAMEM_DEDUPMIN)
+		dedupadd(L, d->dedup, d->ndedup + ++d->nadded, -1);
+}
+
+static void decext (Decoder *d, size_t n) {
+	lua_Integer type = decint(d, 1), i;
+	if (type != LUAMEM_DEDUPEXT || n > 4) decerror(d, "unsupported extension");
+	if (d->dedup == 0) decerror(d, "table of strings expected");
+	i = (lua_Integer)decuint(d, (int)n);
+	lua_rawgeti(d->L, i <= d->ndedup ? d->dedup : d->dedup+1, i);
+	if (lua_type(d->L, -1) != LUA_TSTRING) decerror(d, "invalid string reference");
+}
+
+static void decvalue (Decoder *d, int depth);
+
+static void dectable (Decoder *d, size_t n, int ismap, int depth) {
+	lua_State *L = d->L;
+	size_t i;
+	if (depth > LUAMEM_MAXDEPTH) decerror(d, "table too deep");
+	if (n > (d->len - d->pos) / (ismap ? 2 : 1)) decerror(d, "data too short");
+	luaL_checkstack(L, 4, "table too deep");
+	if (ismap) {
+		lua_createtable(L, 0, n < INT_MAX ? (int)n : INT_MAX);
+		for (i = 0; i < n; i++) {
+			size_t pos = d->pos;
+			decvalue(d, depth);
+			if (lua_isnil(L, -1)
 #ifndef _KERNEL
-			case Kfloat: {  /* floating-point options */
-				volatile Ftypes u;
-				lua_Number n;
-				char *data = getbytes(&mem, &i, lb, size);
-				if (!data) return packfailed(L, i, arg);
-				n = luaL_checknumber(L, arg);  /* get argument */
-				if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-				else if (size == sizeof(u.d)) u.d = (double)n;
-				else u.n = n;
-				/* move 'u' to final result, correcting endianness if needed */
-				copywithendian(data, u.buff, size, h.islittle);
-				break;
-			}
+			    || lua_tonumber(L, -1) != lua_tonumber(L, -1)  /* NaN? */
 #endif /* _KERNEL */
-			case Kchar: {  /* fixed-size string */
-				size_t len;
-				const char *s = luamem_checkstring(L, arg, &len);
-				luaL_argcheck(L, len == (size_t)size, arg, "wrong length");
-				if (!packstream(&mem, &i, lb, s, size))
-					return packfailed(L, i, arg);
-				break;
-			}
-			case Kstring: {  /* strings with length count */
-				size_t len;
-				const char *s = luamem_checkstring(L, arg, &len);
-				luaL_argcheck(L, size >= (int)sizeof(size_t) ||
-				                 len < ((size_t)1 << (size * NB)),
-				                 arg, "string length does not fit in given size");
-				if (!packint(&mem, &i, lb, (lua_Unsigned)len, h.islittle, size, 0) ||  /* pack length */
-				    !packstream(&mem, &i, lb, s, len))
-					return packfailed(L, i, arg);
-				break;
-			}
-			case Kzstr: {  /* zero-terminated string */
-				size_t len;
-				const char *s = luamem_checkstring(L, arg, &len);
-				luaL_argcheck(L, memchr(s, '\0', len) == NULL, arg,
-				                 "string contains zeros");
-				if (!packstream(&mem, &i, lb, s, len) || !packchar(&mem, &i, lb, '\0'))
-					return packfailed(L, i, arg);
-				break;
-			}
-			case Kpadding: {
-				if (!getbytes(&mem, &i, lb, 1))
-					return packfailed(L, i, arg);
-				/* go through */
+			) {
+				d->pos = pos;
+				decerror(d, "invalid table key");
 			}
-			case Kpaddalign: case Knop:
-				arg--;  /* undo increment */
-				break;
+			decvalue(d, depth);
+			lua_rawset(L, -3);
 		}
 	}
-	lua_pushboolean(L, 1);
-	lua_pushinteger(L, i+1);
+	else {
+		lua_createtable(L, n < INT_MAX ? (int)n : INT_MAX, 0);
+		for (i = 1; i <= n; i++) {
+			decvalue(d, depth);
+			lua_rawseti(L, -2, (lua_Integer)i);
+		}
+	}
+}
+
+static void decvalue (Decoder *d, int depth) {
+	lua_State *L = d->L;
+	int c = decbytes(d, 1)[0];
+	if (c < 0x80) lua_pushinteger(L, c);  /* positive fixint */
+	else if (c < 0x90) dectable(d, c & 0x0f, 1, depth + 1);  /* fixmap */
+	else if (c < 0xa0) dectable(d, c & 0x0f, 0, depth + 1);  /* fixarray */
+	else if (c < 0xc0) decstring(d, c & 0x1f);  /* fixstr */
+	else if (c >= 0xe0) lua_pushinteger(L, c - 0x100);  /* negative fixint */
+	else switch (c) {
+		case 0xc0: lua_pushnil(L); break;
+		case 0xc2: lua_pushboolean(L, 0); break;
+		case 0xc3: lua_pushboolean(L, 1); break;
+		case 0xc4: case 0xc5: case 0xc6: {  /* bin */
+			size_t n = (size_t)decuint(d, 1 << (c - 0xc4));
+			lua_pushlstring(L, (const char *)decbytes(d, n), n);
+			break;
+		}
+		case 0xc7: case 0xc8: case 0xc9:  /* ext */
+			decext(d, (size_t)decuint(d, 1 << (c - 0xc7)));
+			break;
+#ifndef _KERNEL
+		case 0xca: {
+			unsigned int u = (unsigned int)decuint(d, 4);
+			float f;
+			memcpy(&f, &u, sizeof(f));
+			lua_pushnumber(L, (lua_Number)f);
+			break;
+		}
+		case 0xcb: {
+			unsigned long long u = (unsigned long long)decuint(d, 8);
+			double f;
+			memcpy(&f, &u, sizeof(f));
+			lua_pushnumber(L, (lua_Number)f);
+			break;
+		}
+#endif /* _KERNEL */
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+			lua_pushinteger(L, (lua_Integer)decuint(d, 1 << (c - 0xcc)));
+			break;
+		case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+			lua_pushinteger(L, decint(d, 1 << (c - 0xd0)));
+			break;
+		case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:  /* fixext */
+			decext(d, (size_t)1 << (c - 0xd4));
+			break;
+		case 0xd9: case 0xda: case 0xdb:
+			decstring(d, (size_t)decuint(d, 1 << (c - 0xd9)));
+			break;
+		case 0xdc: case 0xdd:
+			dectable(d, (size_t)decuint(d, 2 << (c - 0xdc)), 0, depth + 1);
+			break;
+		case 0xde: case 0xdf:
+			dectable(d, (size_t)decuint(d, 2 << (c - 0xde)), 1, depth + 1);
+			break;
+		default:
+			d->pos--;
+			decerror(d, "invalid type");
+	}
+}
+
+static int mem_decode (lua_State *L) {
+	Decoder d;
+	lua_Integer i;
+	d.L = L;
+	d.s = luamem_checkstring(L, 1, &d.len);
+	i = posrelat(luaL_optinteger(L, 2, 1), d.len);
+	luaL_argcheck(L, 1 <= i && i <= (lua_Integer)d.len+1, 2, "index out of bounds");
+	d.pos = (size_t)i - 1;
+	if (lua_isnoneornil(L, 3)) d.dedup = 0;
+	else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		d.dedup = 3;
+		d.ndedup = (lua_Integer)lua_rawlen(L, 3);
+		d.nadded = 0;
+	}
+	lua_settop(L, 3);
+	lua_newtable(L);  /* strings numbered by this call */
+	decvalue(&d, 0);
+	if (d.dedup) dedupmerge(L, 3, d.ndedup + 1, d.ndedup + d.nadded);
+	lua_pushinteger(L, (lua_Integer)d.pos + 1);
 	return 2;
 }
 
+/* }====================================================== */
+
 
 /*
-** Unpack an integer with 'size' bytes and 'islittle' endianness.
-** If size is smaller than the size of a Lua integer and integer
-** is signed, must do sign extension (propagating the sign to the
-** higher bits); if size is larger than the size of a Lua integer,
-** it must check the unread bytes to see whether they do not cause an
-** overflow.
+** {======================================================
+** DELTA ENCODING
+** =======================================================
 */
-static lua_Integer unpackint (lua_State *L, const char *str,
-                              int islittle, int size, int issigned) {
-	lua_Unsigned res = 0;
-	int i;
-	int limit = (size  <= SZINT) ? size : SZINT;
-	for (i = limit - 1; i >= 0; i--) {
-		res <<= NB;
-		res |= (lua_Unsigned)uchar(str[islittle ? i : size - 1 - i]);
+
+/*
+** Returns the first position from 'i' until 'n' where 's1' and 's2'
+** differ, or 'n' if there is none.
+*/
+static size_t skipsame (const char *s1, const char *s2, size_t i, size_t n) {
+#ifdef LUAMEM_USE_SSE2
+	for (; n - i >= 16; i += 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(s1 + i));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(s2 + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2));
+		if (mask != 0xffff) return i + __builtin_ctz(~mask);
 	}
-	if (size < SZINT) {  /* real size smaller than lua_Integer? */
-		if (issigned) {  /* needs sign extension? */
-			lua_Unsigned mask = (lua_Unsigned)1 << (size*NB - 1);
-			res = ((res ^ mask) - mask);  /* do sign extension */
-		}
+#endif /* LUAMEM_USE_SSE2 */
+	for (; n - i >= sizeof(size_t); i += sizeof(size_t)) {
+		size_t w1, w2;
+		memcpy(&w1, s1 + i, sizeof(size_t));
+		memcpy(&w2, s2 + i, sizeof(size_t));
+		if (w1 != w2) break;
 	}
-	else if (size > SZINT) {  /* must check unread bytes */
-		int mask = (!issigned || (lua_Integer)res >= 0) ? 0 : MC;
-		for (i = limit; i < size; i++) {
-			if (uchar(str[islittle ? i : size - 1 - i]) != mask)
-				luaL_error(L, "%d-byte integer does not fit into Lua Integer", size);
-		}
+	while (i < n && s1[i] == s2[i]) i++;
+	return i;
+}
+
+/*
+** Returns the first position from 'i' until 'n' where 's1' and 's2'
+** are equal, or 'n' if there is none.
+*/
+static size_t skipdiff (const char *s1, const char *s2, size_t i, size_t n) {
+#ifdef LUAMEM_USE_SSE2
+	for (; n - i >= 16; i += 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(s1 + i));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(s2 + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2));
+		if (mask != 0) return i + __builtin_ctz(mask);
 	}
-	return (lua_Integer)res;
+#endif /* LUAMEM_USE_SSE2 */
+	while (i < n && s1[i] != s2[i]) i++;
+	return i;
 }
 
+/*
+** Returns the end of the range of blocks of 'g' bytes that differ in 's1'
+** and 's2' starting at block 'i', up to 'n'.
+*/
+static size_t diffblocks (const char *s1, const char *s2, size_t i, size_t n,
+                          size_t g) {
+	if (g == 1) return skipdiff(s1, s2, i, n);
+	for (i += g; i < n; i += g) {
+		size_t e = (n - i < g) ? n : i + g;
+		if (skipsame(s1, s2, i, e) == e) break;  /* equal block? */
+	}
+	return i < n ? i : n;
+}
 
-static int mem_unpack (lua_State *L) {
-	Header h;
-	size_t ld;
-	const char *data = luamem_checkmemory(L, 1, &ld);
-	const char *fmt = luaL_checkstring(L, 2);
-	size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
-	int n = 0;  /* number of results */
-	luaL_argcheck(L, pos <= ld, 3, "initial position out of bounds");
-	initheader(L, &h);
-	while (*fmt != '\0') {
-		int size, ntoalign;
-		KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-		if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
-			luaL_argerror(L, 1, "data too short");
-		pos += ntoalign;  /* skip alignment */
-		/* stack space for item + next position */
-		luaL_checkstack(L, 1, "too many results");
-		n++;
-		switch (opt) {
-			case Kint:
-			case Kuint: {
-				lua_Integer res = unpackint(L, data + pos, h.islittle, size,
-				                               (opt == Kint));
-				lua_pushinteger(L, res);
-				break;
-			}
-#ifndef _KERNEL
-			case Kfloat: {
-				volatile Ftypes u;
-				lua_Number num;
-				copywithendian(u.buff, data + pos, size, h.islittle);
-				if (size == sizeof(u.f)) num = (lua_Number)u.f;
-				else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-				else num = u.n;
-				lua_pushnumber(L, num);
-				break;
-			}
-#endif /* _KERNEL */
-			case Kchar: {
-				lua_pushlstring(L, data + pos, size);
-				break;
-			}
-			case Kstring: {
-				size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
-				luaL_argcheck(L, pos + len + size <= ld, 2, "data string too short");
-				lua_pushlstring(L, data + pos + size, len);
-				pos += len;  /* skip string */
-				break;
-			}
-			case Kzstr: {
-				size_t len;
-				const char *z = (const char *)memchr(data + pos, '\0', ld - pos);
-				luaL_argcheck(L, z, 2, "data string too short");
-				len = (size_t)(z - data - pos);
-				lua_pushlstring(L, data + pos, len);
-				pos += len + 1;  /* skip string plus final '\0' */
-				break;
-			}
-			case Kpaddalign: case Kpadding: case Knop:
-				n--;  /* undo increment */
-				break;
-		}
-		pos += size;
+/* output of the delta, which is the memory at index 4 */
+typedef struct Delta {
+	lua_State *L;
+	char *mem;
+	size_t len;
+	size_t pos;  /* position to write in 'mem' */
+} Delta;
+
+static void deltareserve (Delta *D, size_t n) {
+	if (n > D->len - D->pos) {
+		size_t size = D->len < LUAMEM_MAXALLOC/2 ? D->len*2 : LUAMEM_MAXALLOC;
+		luaL_argcheck(D->L, n <= LUAMEM_MAXALLOC - D->pos, 4, "memory too large");
+		if (size < D->pos + n) size = D->pos + n;
+		D->mem = growoutput(D->L, 4, D->mem, &D->len, size);
 	}
-	lua_pushinteger(L, pos + 1);  /* next position */
-	return n + 1;
+}
+
+static void deltaint (Delta *D, size_t n) {
+	char buff[MAXVARINT], *b = buff;
+	size_t size = 0;
+	packvarint(&b, &size, MAXVARINT, (lua_Unsigned)n);
+	deltareserve(D, size);
+	memcpy(D->mem + D->pos, buff, size);
+	D->pos += size;
+}
+
+/*
+** Writes the range of 'size' bytes of the new contents (argument 2) at
+** 'off', which is 'gap' bytes after the end of the previous range.
+*/
+static void deltarange (Delta *D, size_t gap, size_t off, size_t size) {
+	deltaint(D, gap);
+	deltaint(D, size);
+	deltareserve(D, size);  /* might move contents of arguments */
+	memcpy(D->mem + D->pos, luamem_tostring(D->L, 2, NULL) + off, size);
+	D->pos += size;
+}
+
+static int mem_delta (lua_State *L) {
+	Delta D;
+	size_t lo, ln, g, n, i, last = 0, init;
+	const char *o = luamem_checkstring(L, 1, &lo);
+	const char *s = luamem_checkstring(L, 2, &ln);
+	lua_Integer gi = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, 1 <= gi && gi <= (lua_Integer)LUAMEM_MAXALLOC, 3,
+	                 "invalid granularity");
+	g = (size_t)gi;
+	if (lua_isnoneornil(L, 4)) {
+		lua_settop(L, 3);
+		luamem_newref(L);
+		luamem_setref(L, 4, NULL, 0, luamem_free);
+		D.mem = NULL;
+		D.len = D.pos = 0;
+	}
+	else D.mem = checkoutput(L, 4, &D.len, &D.pos);
+	D.L = L;
+	init = D.len;
+	deltaint(&D, ln);
+	n = lo < ln ? lo : ln;
+	for (i = 0; i < n; ) {
+		size_t e;
+		o = luamem_tostring(L, 1, NULL);  /* output might move arguments */
+		s = luamem_tostring(L, 2, NULL);
+		i = skipsame(o, s, i, n);
+		if (i == n) break;
+		i -= i % g;  /* start of the block */
+		e = diffblocks(o, s, i, n, g);
+		if (e == n && n < ln) e = ln;  /* include the rest of the new */
+		deltarange(&D, i - last, i, e - i);
+		last = i = e;
+	}
+	if (last < ln && lo < ln) deltarange(&D, lo - last, lo, ln - lo);
+	if (D.pos < D.len && init < D.len)  /* release the reserve */
+		resizemem(L, 4, D.mem, D.len, D.pos > init ? D.pos : init);
+	lua_pushvalue(L, 4);
+	lua_pushinteger(L, (lua_Integer)D.pos + 1);
+	return 2;
+}
+
+/*
+** Reads a size in variable-length encoding from 'p' up to 'e', returning
+** the position after it, or NULL if it is not valid.
+*/
+static const char *getdeltaint (const char *p, const char *e, size_t *n) {
+	lua_Unsigned u;
+	int len = unpackvarint(p, (size_t)(e - p), &u);
+	if (len <= 0 || u > (lua_Unsigned)LUAMEM_MAXALLOC) return NULL;
+	*n = (size_t)u;
+	return p + len;
+}
+
+static int mem_patch (lua_State *L) {
+	size_t ld, lp, newlen, at = 0, total = 0;
+	luamem_Unref unref;
+	char *dst;
+	const char *p, *e, *q;
+	luamem_checkmemory(L, 1, NULL);
+	dst = luamem_tomemoryx(L, 1, &ld, &unref, NULL);
+	p = luamem_checkstring(L, 2, &lp);
+	e = p + lp;
+	q = getdeltaint(p, e, &newlen);
+	if (q == NULL) return invaliddata(L, 2, p);
+	while (q < e) {  /* validate the ranges before changing anything */
+		size_t gap, size;
+		const char *r = getdeltaint(q, e, &gap);
+		if (r) r = getdeltaint(r, e, &size);
+		if (r == NULL || gap > newlen - at || size > newlen - at - gap ||
+		    size > (size_t)(e - r))
+			return invaliddata(L, 2, q);
+		at += gap + size;
+		q = r + size;
+	}
+	if (newlen != ld) {
+		luaL_argcheck(L, unref == luamem_free, 1, "memory size does not match");
+		dst = resizemem(L, 1, dst, ld, newlen);
+		if (newlen > ld) memsetpar(dst + ld, 0, newlen - ld);
+		p = luamem_tostring(L, 2, &lp);  /* 'dst' might be the delta */
+		e = p + lp;
+	}
+	q = getdeltaint(p, e, &newlen);
+	for (at = 0; q < e; ) {
+		size_t gap = 0, size = 0;
+		q = getdeltaint(getdeltaint(q, e, &gap), e, &size);
+		at += gap;
+		memmove(dst + at, q, size);
+		at += size;
+		q += size;
+		total += size;
+	}
+	lua_pushinteger(L, (lua_Integer)total);
+	return 1;
 }
 
 /* }====================================================== */
@@ -0,0 +1,31 @@
+local memory = require "memory"
+
+-- measures the throughput of 'memory.fill' for different pattern lengths
+-- and memory sizes, in GB/s of CPU time (see 'memory.setthreads')
+
+local sizes = { 4*1024, 256*1024, 16*1024*1024, 256*1024*1024 }
+local lengths = { 1, 2, 3, 4, 7, 8, 16, 31, 32, 64 }
+local volume = 1024*1024*1024  -- bytes filled for each measure
+
+local header = { "length" }
+for _, size in ipairs(sizes) do
+	header[#header+1] = string.format("%8dK", size//1024)
+end
+print(table.concat(header, "\t"))
+
+for _, len in ipairs(lengths) do
+	local pattern = string.rep("x", len)
+	local line = { string.format("%6d", len) }
+	for _, size in ipairs(sizes) do
+		local m = memory.create(size)
+		memory.fill(m, pattern)  -- map the pages before measuring
+		local times = math.max(volume//size, 1)
+		local start = os.clock()
+		for _ = 1, times do
+			memory.fill(m, pattern)
+		end
+		local elapsed = os.clock() - start
+		line[#line+1] = string.format("%9.2f", times*size/elapsed/1e9)
+	end
+	print(table.concat(line, "\t"))
+end
@@ -593,4 +593,1063 @@ do print "memory.resize(m, size [, s])"
 	assert(tostring(m) == "abcde\0\0\0\0\0")
 end
 
+do print "memory.ring(m)"
+	local r = memory.ring(256)
+	assert(r:pop() == nil)
+	assert(r:peek() == nil)
+	assert(r:push("hello") == true)
+	assert(r:push(memory.create("world!"), 1, 5) == true)
+	assert(r:push("") == true)
+	local v = r:peek()
+	assert(memory.type(v) == "other")
+	assert(tostring(v) == "hello")
+	assert(r:pop() == "hello")
+	asserterr("memory too small", r.pop, r, memory.create(2))
+	local m = memory.create()
+	assert(r:pop(m) == 5)
+	assert(tostring(m) == "world")
+	assert(r:pop(m, 6) == 0)
+	assert(tostring(m) == "world")
+	assert(r:pop() == nil)
+	asserterr("message too large", r.push, r, string.rep("x", 256))
+
+	for i = 1, 1000 do
+		local s = string.rep(string.char(i%256), i%100)
+		assert(r:push(s) == true)
+		assert(r:pop() == s)
+	end
+
+	local n = 0
+	while r:push(string.format("%8d", n)) do n = n+1 end
+	assert(n > 0)
+	local t = {}
+	assert(r:popbatch(t, 1) == 1)
+	assert(t[1] == string.format("%8d", 0))
+	assert(r:popbatch(t) == n-1)
+	assert(#t == n-1)
+	assert(t[n-1] == string.format("%8d", n-1))
+	assert(r:pushbatch{ "a", memory.create("b"), "c" } == 3)
+
+	local r2 = memory.ring(r:memory())
+	assert(r2:pop() == "a")
+	assert(r:pop() == "b")
+	assert(r2:pop() == "c")
+	assert(r:pop() == nil)
+
+	asserterr("memory too small", memory.ring, memory.create(16))
+end
+
+do print "memory.setthreads([n [, size]])"
+	local n, size = memory.setthreads()
+	assert(n == 1)
+	assert(size > 0)
+	local oldn, oldsize = memory.setthreads(4, 4096)
+	assert(oldn == n and oldsize == size)
+	local data = string.rep("0123456789ABCDEF", 4096)
+	local m = memory.create(data)
+	assert(memory.diff(m, data) == nil)
+	memory.set(m, 40000, 0)
+	assert(memory.diff(m, data) == 40000)
+	memory.fill(m, "xyz", 2)
+	assert(memory.diff(m, "0"..string.rep("xyz", #data//3)) == nil)
+	memory.fill(m, 0)
+	assert(memory.diff(memory.create(#data), m) == nil)
+	local r = memory.create()
+	memory.resize(r, #data, "0123456789ABCDEF")
+	assert(memory.diff(r, data) == nil)
+	oldn, oldsize = memory.setthreads(n, size)
+	assert(oldn == 4 and oldsize == 4096)
+	asserterr("invalid number of threads", memory.setthreads, 0)
+end
+
+do print "memory.compress(m, i, s [, j [, k]]), memory.decompress(m, i, s [, j [, k]])"
+	local function check(data)
+		for _, S in ipairs({tostring, memory.create}) do
+			local c = memory.create()
+			local n = memory.compress(c, 1, S(data))
+			assert(n == #c)
+			local d = memory.create()
+			assert(memory.decompress(d, 1, c) == #data)
+			assert(memory.diff(d, data) == nil)
+			local f = memory.create(#data+2)
+			assert(memory.decompress(f, 2, c, 1, n) == #data)
+			assert(memory.tostring(f, 2, -2) == data)
+		end
+	end
+	check("")
+	check("a")
+	check("Hello, world!")
+	check(string.rep("abc", 1000))
+	check(string.rep("\0", 65536).."x"..string.rep("\0", 100))
+	local random = {}
+	for i = 1, 1000 do random[i] = string.char((i*7919)%251) end
+	check(table.concat(random))
+
+	-- an uncompressed literal block
+	local d = memory.create()
+	assert(memory.decompress(d, 1, "\x50hello") == 5)
+	assert(tostring(d) == "hello")
+	-- offset to before the beginning of the output
+	local res, pos = memory.decompress(memory.create(), 1, "\x10a\x02\0")
+	assert(res == nil and pos == 1)
+	local res, pos = memory.decompress(memory.create(), 1, "\xf0")
+	assert(res == nil and pos == 2)
+
+	local c = memory.create()
+	memory.compress(c, 1, string.rep("x", 100))
+	local m = newresizable("0123456789")
+	local n = memory.compress(m, 11, string.rep("x", 100))
+	assert(memory.tostring(m, 1, 10) == "0123456789")
+	assert(memory.tostring(m, 11) == tostring(c))
+	asserterr("memory too small", memory.compress, memory.create(3), 1, string.rep("x", 100))
+	asserterr("memory too small", memory.decompress, memory.create(3), 1, c)
+	asserterr("index out of bounds", memory.compress, memory.create(3), 5, "")
+
+	local r = newresizable(string.rep("a", 100))
+	local n = memory.compress(r, #r+1, r)
+	local c = memory.tostring(r, 101)
+	assert(n == #c)
+	assert(memory.decompress(r, #r+1, r, 101) == 100)
+	assert(memory.tostring(r, 101+n) == string.rep("a", 100))
+end
+
+do print "memory.tohex/fromhex/tobase64/frombase64(m, i, s [, j [, k]])"
+	local function check(data, hex, b64)
+		for _, S in ipairs({tostring, memory.create}) do
+			for enc, expected in pairs{ hex = hex, base64 = b64 } do
+				local m = memory.create()
+				assert(memory["to"..enc](m, 1, S(data)) == #expected)
+				assert(tostring(m) == expected)
+				local d = memory.create()
+				assert(memory["from"..enc](d, 1, S(expected)) == #data)
+				assert(tostring(d) == data)
+				local f = memory.create(#expected+2)
+				assert(memory["to"..enc](f, 2, S("<"..data..">"), 2, -2) == #expected)
+				assert(memory.tostring(f, 2, -2) == expected)
+			end
+		end
+	end
+	check("", "", "")
+	check("f", "66", "Zg==")
+	check("fo", "666f", "Zm8=")
+	check("foo", "666f6f", "Zm9v")
+	check("foob", "666f6f62", "Zm9vYg==")
+	check("fooba", "666f6f6261", "Zm9vYmE=")
+	check("foobar", "666f6f626172", "Zm9vYmFy")
+	local all = {}
+	for i = 0, 255 do all[#all+1] = string.char(i) end
+	all = table.concat(all)
+	local m = memory.create()
+	memory.tohex(m, 1, all)
+	assert(tostring(m) == all:gsub(".", function (c) return string.format("%02x", c:byte()) end))
+	local d = memory.create()
+	assert(memory.fromhex(d, 1, tostring(m):upper()) == 256)
+	assert(tostring(d) == all)
+	local n = memory.tobase64(m, 1, all)
+	assert(memory.frombase64(d, 1, m, 1, n) == 256)
+	assert(tostring(d) == all)
+
+	local function checkinvalid(dec, s, pos)
+		local r = newresizable("ab")
+		local res, p = memory[dec](r, 3, s)
+		assert(res == nil and p == pos)
+		assert(#r == 2)  -- keeps its size
+	end
+	checkinvalid("fromhex", "0g", 2)
+	checkinvalid("fromhex", "abc", 3)
+	checkinvalid("fromhex", string.rep("0", 100).."x0", 101)
+	checkinvalid("frombase64", "Zg=", 1)
+	checkinvalid("frombase64", "Z===", 2)
+	checkinvalid("frombase64", "Zm9v*g==", 5)
+	checkinvalid("frombase64", "Zg==Zg==", 3)
+	asserterr("memory too small", memory.tohex, memory.create(3), 1, "ab")
+	asserterr("memory too small", memory.frombase64, memory.create(3), 2, "Zm9v")
+
+	local data = string.rep("\0\1\254\255", 25)
+	for _, codec in ipairs{{"tohex", "fromhex"}, {"tobase64", "frombase64"}} do
+		local enc, dec = memory[codec[1]], memory[codec[2]]
+		local r = newresizable(data)
+		local n = enc(r, #r+1, r)
+		assert(#r == 100+n)
+		local e = memory.create()
+		enc(e, 1, data)
+		assert(memory.tostring(r, 101) == tostring(e))
+		assert(dec(r, #r+1, r, 101) == 100)
+		assert(memory.tostring(r, 101+n) == data)
+		local size = #r
+		memory.set(r, 101, 0x2a)  -- '*' is not a digit
+		local res, p = dec(r, #r+1, r, 101, 100+n)
+		assert(res == nil and p == 101 and #r == size)
+	end
+end
+
+do print "memory.bswap(m, width [, i [, j]])"
+	local m = memory.create("0123456789abcdef")
+	memory.bswap(m, 2)
+	assert(tostring(m) == "1032547698badcfe")
+	memory.bswap(m, 2)
+	memory.bswap(m, 4, 1, 8)
+	assert(tostring(m) == "3210765489abcdef")
+	memory.bswap(m, 4, 1, 8)
+	memory.bswap(m, 8)
+	assert(tostring(m) == "76543210fedcba98")
+	memory.bswap(m, 8)
+	memory.bswap(m, 3, 2, -4)
+	assert(tostring(m) == "0321654987cbadef")
+	memory.bswap(m, 16)
+	assert(tostring(m) == "fedabc7894561230")
+	memory.bswap(m, 1)
+	memory.bswap(m, 4, 3, 2)
+	local s = {}
+	for i = 0, 255 do s[#s+1] = string.char(i) end
+	s = table.concat(s)
+	for _, w in ipairs{2, 4, 8} do
+		local m = memory.create(s)
+		memory.bswap(m, w)
+		local expected = s:gsub(string.rep(".", w), string.reverse)
+		assert(tostring(m) == expected)
+	end
+	asserterr("width out of limits", memory.bswap, m, 0)
+	asserterr("width out of limits", memory.bswap, m, 17)
+	asserterr("range is not a multiple of width", memory.bswap, m, 3)
+	asserterr("index out of bounds", memory.bswap, m, 2, 0, 4)
+	asserterr("index out of bounds", memory.bswap, m, 2, 1, 17)
+end
+
+do print "memory.convert(dst, dfmt, src, sfmt [, count [, di [, si]]])"
+	local values = { 1, -2, 300, -40000, 0x7fffffff, -0x80000000 }
+	local src = string.pack("<"..string.rep("i4", #values), table.unpack(values))
+	local m = memory.create()
+	assert(memory.convert(m, ">i4", src, "<i4") == #values)
+	assert(tostring(m) == string.pack(">"..string.rep("i4", #values), table.unpack(values)))
+	assert(memory.convert(m, "<i8", src, "<i4") == #values)
+	assert(tostring(m) == string.pack("<"..string.rep("i8", #values), table.unpack(values)))
+	assert(memory.convert(m, "d", m, "<i8") == #values)
+	assert(tostring(m) == string.pack(string.rep("d", #values), table.unpack(values)))
+	assert(memory.convert(m, "i2", m, "d", 3) == 3)
+	assert(memory.unpack(m, "i2i2i2", 1) == 1)
+	assert(select(3, memory.unpack(m, "i2i2i2", 1)) == 300)
+	local f = memory.create(8)
+	assert(memory.convert(f, "B", "\1\0\2\0\3\0", "<H", 2, 7, 3) == 2)
+	assert(tostring(f) == "\0\0\0\0\0\0\2\3")
+	assert(memory.convert(f, "B", "", "H") == 0)
+	asserterr("memory too small", memory.convert, f, "i2", "\1\2", "B", nil, 8)
+	asserterr("integer overflow", memory.convert, memory.create(), "i1", string.pack("i2", 128), "i2")
+	asserterr("unsigned overflow", memory.convert, memory.create(), "B", string.pack("i2", -1), "i2")
+	asserterr("no integer representation", memory.convert, memory.create(), "i4", string.pack("d", 0.5), "d")
+	asserterr("data too short", memory.convert, memory.create(), "i4", "abc", "i2", 2)
+	asserterr("invalid element format", memory.convert, memory.create(), "i4i4", "abcd", "i4")
+	asserterr("invalid element format", memory.convert, memory.create(), "i4", "abcd", "s4")
+end
+
+do print "memory.pack(m, fmt, i, ...) with variable-length integers"
+	local function leb128(n)
+		local t = {}
+		repeat
+			local b = n & 0x7f
+			n = n >> 7
+			t[#t+1] = string.char(n ~= 0 and b | 0x80 or b)
+		until n == 0
+		return table.concat(t)
+	end
+	local function zigzag(n) return (n << 1) ~ (n >> 63 ~= 0 and -1 or 0) end
+	local values = { 0, 1, -1, 63, -64, 64, 127, 128, 300, -300, 16383, 16384,
+		1 << 31, -(1 << 31), 1 << 55, (1 << 56) - 1, 1 << 56,
+		math.maxinteger, math.mininteger }
+	for _, n in ipairs(values) do
+		for fmt, enc in pairs{ V = leb128(n), v = leb128(zigzag(n)) } do
+			local m = memory.create(#enc + 16)
+			assert(assertret({true}, memory.pack(m, fmt, 2, n)) == #enc + 2)
+			assert(memory.tostring(m, 2, #enc + 1) == enc)
+			assert(assertret({n}, memory.unpack(m, fmt, 2)) == #enc + 2)
+			assert(assertret({n}, memory.unpack(memory.create(enc), fmt)) == #enc + 1)
+			local s = memory.create(#enc - 1)
+			assert(memory.pack(s, fmt, 1, n) == false)
+		end
+	end
+	local m = memory.create(64)
+	assert(assertret({true}, memory.pack(m, "<Vvi2Vz", 1, 300, -2, 7, 1 << 40, "")) == 13)
+	assert(assertret({300, -2, 7, 1 << 40, ""}, memory.unpack(m, "<Vvi2Vz", 1)) == 13)
+	asserterr("data too short", memory.unpack, memory.create("\x80\x80"), "V")
+	asserterr("data too short", memory.unpack, memory.create(""), "v")
+	asserterr("does not fit", memory.unpack, memory.create(string.rep("\xff", 9).."\x02"), "V")
+	asserterr("does not fit", memory.unpack, memory.create(string.rep("\x80", 10).."\x00"), "V")
+	assert(assertret({0}, memory.unpack(memory.create(string.rep("\x80", 9).."\x00"), "V")) == 11)
+end
+
+do print "memory.packappend(m, fmt, ...)"
+	local m = memory.create()
+	assert(memory.packappend(m, "<i4", 1) == 5)
+	assert(memory.packappend(m, ">s2z", "abc", "de") == 13)
+	assert(memory.packappend(m, "") == 13)
+	assert(memory.packappend(m, "!4bXi4i4", 7, 8) == 21)
+	assert(tostring(m) == string.pack("<i4>s2z", 1, "abc", "de")..string.pack("!4bXi4i4", 7, 8))
+	local parts = {}
+	for i = 1, 1000 do
+		local s = string.rep(string.char(i % 256), i % 37)
+		local b = memory.create(64)
+		local _, n = memory.pack(b, "<Vs4j", 1, i, s, -i)
+		parts[#parts+1] = memory.tostring(b, 1, n-1)
+		assert(memory.packappend(m, "<Vs4j", i, s, -i) == #m + 1)
+	end
+	assert(memory.tostring(m, 21) == table.concat(parts))
+	local big = string.rep("x", 1 << 20)
+	local m = memory.create()
+	assert(memory.packappend(m, "bs4b", 1, big, 2) == (1 << 20) + 7)
+	assert(tostring(m) == string.pack("bs4b", 1, big, 2))
+	asserterr("resizable memory expected", memory.packappend, memory.create(10), "i4", 1)
+	asserterr("integer overflow", memory.packappend, m, "i1", 1000)
+	assert(#m == (1 << 20) + 6)  -- left unchanged
+	asserterr("integer overflow", memory.packappend, m, "s4i1", big, 1000)
+	assert(#m == (1 << 20) + 6)
+	local m = newresizable("self")
+	assert(memory.packappend(m, "zs1", m, m) == 4+5+5+1)
+	assert(tostring(m) == "selfself\0\4self")
+	for i = 1, 3 do memory.packappend(m, "s4", m) end
+	assert(#m == 140)  -- 14, 14+4+14, 32+4+32, 68+4+68
+end
+
+do print "memory.release(m), memory.pressure([threshold])"
+	collectgarbage()
+	local base, threshold = memory.pressure()
+	assert(threshold > 0)
+	local n, t = memory.pressure(0)
+	assert(n == base and t == threshold)
+	local m = memory.create()
+	memory.resize(m, 1000)
+	assert(memory.pressure() == base + 1000)
+	memory.resize(m, 100)
+	assert(memory.pressure() == base + 100)
+	memory.release(m)
+	assert(memory.pressure() == base)
+	assert(memory.type(m) == "resizable")
+	assert(memory.len(m) == 0)
+	memory.resize(m, 10, "x")
+	assert(tostring(m) == string.rep("x", 10))
+	memory.release(m)
+	memory.release(m)
+	asserterr("referenced memory expected", memory.release, memory.create(10))
+	asserterr("invalid threshold", memory.pressure, -1)
+	n, t = memory.pressure(1 << 16)
+	assert(n == base and t == 0)
+	for i = 1, 100 do
+		local m = memory.create()
+		memory.resize(m, 1 << 16)
+	end
+	assert(memory.pressure() < base + 100 * (1 << 16))
+	n, t = memory.pressure(threshold)
+	assert(n == memory.pressure() and t == 1 << 16)
+end
+
+do print "memory.create(n) with mapped pages"
+	collectgarbage()
+	local base = memory.pressure()
+	local size = 64 << 20
+	local m = memory.create(size)
+	assert(memory.type(m) == "fixed")
+	assert(memory.len(m) == size)
+	assert(memory.get(m, 1) == 0 and memory.get(m, size) == 0)
+	assert(memory.find(m, "\1") == nil)
+	memory.set(m, size, 1)
+	assert(memory.find(m, "\1") == size)
+	asserterr("memory too small", memory.tohex, m, size, "ab")
+	local used = memory.pressure() - base
+	if used == size then  -- pages were mapped
+		memory.release(m)
+		assert(memory.type(m) == "fixed")
+		assert(memory.len(m) == 0)
+		assert(memory.pressure() == base)
+	end
+end
+
+do print "memory.create(n, {align=a, hugepages=h}), memory.alignment(m)"
+	assert(memory.alignment(memory.create()) == nil)
+	assert(memory.alignment(memory.create(64)) >= 1)
+	for _, n in ipairs{0, 1, 100, 4096, 5000, 3 << 20} do
+		for _, a in ipairs{1, 64, 4096, 1 << 16, 1 << 22} do
+			local m = memory.create(n, {align = a})
+			assert(memory.type(m) == "fixed")
+			assert(memory.len(m) == n)
+			if n > 0 then
+				assert(memory.alignment(m) >= math.max(a, 4096))
+				assert(memory.get(m, 1) == 0 and memory.get(m, n) == 0)
+				memory.fill(m, "x")
+				assert(memory.get(m, n) == string.byte("x"))
+			end
+			memory.release(m)
+			assert(memory.len(m) == 0)
+		end
+	end
+	local m = memory.create(5 << 20, {hugepages = true})
+	assert(memory.alignment(m) >= 2 << 20)
+	memory.fill(m, "abc")
+	assert(memory.tostring(m, -3, -1) == "cab")
+	asserterr("alignment must be a power of 2", memory.create, 10, {align = 3})
+	asserterr("alignment must be a power of 2", memory.create, 10, {align = 0})
+	asserterr("table expected", memory.create, 10, 2)
+end
+
+do print "memory.snapshot(m)"
+	for _, size in ipairs{0, 10, 3 << 20} do
+		local m = memory.create(size)
+		if size > 0 then memory.fill(m, "abc") end
+		local s = memory.snapshot(m)
+		assert(memory.type(s) == "fixed")
+		assert(memory.diff(m, s) == nil)
+		if size > 0 then
+			memory.set(m, 1, 1)
+			memory.set(s, size, 2)
+			assert(memory.get(s, 1) == string.byte("a"))
+			assert(memory.get(m, size) == string.byte("abc", (size - 1) % 3 + 1))
+		end
+	end
+	local size = (3 << 20) + 100
+	local m = memory.create(size)
+	memory.fill(m, "xyz", 4000)
+	local s1 = memory.snapshot(m)
+	memory.set(m, 5000, 1)
+	local s2 = memory.snapshot(m)  -- while 's1' is in use
+	memory.set(m, size, 2)
+	assert(memory.get(s1, 5000) == string.byte("y"))
+	assert(memory.get(s2, 5000) == 1)
+	assert(memory.get(s2, size) == string.byte("x"))
+	memory.release(s1)
+	memory.release(s2)
+	memory.set(m, 1, 3)
+	local s3 = memory.snapshot(m)  -- the only snapshot
+	assert(memory.diff(m, s3) == nil)
+	memory.set(m, 4000, 4)
+	memory.set(s3, 4001, 5)
+	assert(memory.get(s3, 4000) == string.byte("x"))
+	assert(memory.get(m, 4001) == string.byte("y"))
+	local s4 = memory.snapshot(s3)
+	assert(memory.diff(s3, s4) == nil)
+	local r = newresizable("abc")
+	local s = memory.snapshot(r)
+	assert(memory.type(s) == "fixed" and tostring(s) == "abc")
+	assert(memory.len(memory.snapshot(memory.create())) == 0)
+
+	local many = {}
+	for i = 1, 2000 do many[i] = memory.create(1 << 20) end
+	local name = os.tmpname()  -- memories do not take a file descriptor each
+	assert(io.open(name, "w")):close()
+	os.remove(name)
+	memory.fill(many[1], "a")
+	memory.fill(many[2], "b")
+	memory.release(many[1])
+	local s = memory.snapshot(many[2])
+	memory.fill(many[2], "c")
+	assert(memory.get(s, 1) == string.byte("b") and memory.get(s, 1 << 20) == string.byte("b"))
+	assert(memory.get(many[3], 1) == 0)
+
+	local m = memory.create(1 << 20)
+	local ring = memory.ring(m)  -- pages are not discarded from 'm' anymore
+	assert(ring:push("abc"))
+	local s = memory.snapshot(m)
+	assert(memory.diff(m, s) == nil)
+	assert(ring:pop() == "abc")
+	assert(memory.diff(m, s) ~= nil)
+	local r = memory.ring(s)
+	assert(r:pop() == "abc" and r:pop() == nil)
+end
+
+do print "memory.delta(old, new [, g [, m [, i]]]), memory.patch(m, d)"
+	local function check(old, new, g)
+		local d, e = memory.delta(old, new, g)
+		assert(memory.type(d) == "resizable" and e == #d + 1)
+		local m = newresizable(old)
+		assert(memory.patch(m, d) <= #new)
+		assert(tostring(m) == new)
+		if #old == #new then
+			local f = memory.create(old)
+			memory.patch(f, d)
+			assert(tostring(f) == new)
+		end
+		return d
+	end
+	assert(tostring(check("", "")) == "\0")
+	assert(tostring(check("abc", "abc")) == "\3")
+	assert(tostring(check("abcdef", "abXdeY")) == "\6\2\1X\2\1Y")
+	assert(tostring(check("abcdef", "abXdeY", 4)) == "\6\0\6abXdeY")
+	assert(tostring(check("abcdef", "abXdeY", 2)) == "\6\2\4XdeY")
+	assert(tostring(check("abcdefgh", "abXdefgY", 2)) == "\8\2\2Xd\2\2gY")
+	assert(tostring(check("abc", "abcde")) == "\5\3\2de")
+	assert(tostring(check("abc", "aXcde")) == "\5\1\1X\1\2de")
+	assert(tostring(check("abc", "aX")) == "\2\1\1X")
+	assert(tostring(check("abcdef", "")) == "\0")
+	math.randomseed(42)
+	for _, size in ipairs{1, 15, 16, 17, 100, 1000, 4096} do
+		local old = {}
+		for i = 1, size do old[i] = string.char(math.random(0, 255)) end
+		old = table.concat(old)
+		for _, changes in ipairs{0, 1, 5, 50} do
+			local new = memory.create(old)
+			for _ = 1, changes do
+				memory.set(new, math.random(1, size), math.random(0, 255))
+			end
+			new = tostring(new)
+			for _, g in ipairs{1, 3, 8, 64} do
+				check(old, new, g)
+				check(old, new..string.rep("z", g), g)
+				check(old, new:sub(1, size // 2), g)
+			end
+		end
+	end
+	local m = memory.create(10)
+	local d, e = memory.delta("abc", "abX", 1, m, 4)
+	assert(d == m and e == 8)
+	assert(memory.tostring(m, 4, 7) == "\3\2\1X")
+	asserterr("memory too small", memory.delta, "abc", "XYZ", 1, m, 8)
+	local r = newresizable("xy")
+	d, e = memory.delta("abc", "XYZ", 1, r, 3)
+	assert(d == r and tostring(r) == "xy\3\0\3XYZ" and e == 9)
+
+	local f = memory.create("abc")
+	asserterr("memory size does not match", memory.patch, f, "\4")
+	local res, pos = memory.patch(f, "\3\2\2XY")
+	assert(res == nil and pos == 2)
+	res, pos = memory.patch(f, "\3\1\1X\1\2Y")
+	assert(res == nil and pos == 5)
+	res, pos = memory.patch(f, "\3\1\1")
+	assert(res == nil and pos == 2)
+	res, pos = memory.patch(f, "\128")
+	assert(res == nil and pos == 1)
+	assert(tostring(f) == "abc")
+end
+
+if memory.profile then print "memory.profile([reset])"
+	memory.profile(true)
+	local m = memory.create(100)
+	for _ = 1, 10 do memory.fill(m, "abc") end
+	memory.find(m, "cab", 1)
+	local p = memory.profile()
+	assert(p.fill.calls == 10)
+	assert(p.fill.bytes == 10 * (100 + 3))
+	assert(p.find.calls == 1 and p.find.bytes == 103)
+	local total = 0
+	for _, n in ipairs(p.fill.durations) do total = total + n end
+	assert(total == 10)
+	assert(p.fill.cycles > 0)
+	assert(p.create.calls == 1 and p.create.bytes == 0)
+	asserterr("string or memory expected", memory.fill, m, {})
+	p = memory.profile(true)
+	assert(p.fill.calls == 11 and p.fill.bytes == 10 * 103 + 100)
+	p = memory.profile()
+	assert(p.fill == nil)
+	assert(next(p) == nil)
+end
+
+do print "memory.index()"
+	local x = memory.index()
+	assert(#x == 0)
+	assert(x:get("key") == nil)
+	x:set(1, "key")
+	x:set("value", memory.create("a key b"), 3, 5)
+	assert(#x == 1)
+	x:set(true, "")
+	assert(#x == 2)
+	assert(x:get("key") == "value")
+	assert(x:get(memory.create("keys"), 1, 3) == "value")
+	assert(x:get("", 1, 0) == true)
+	assert(x:get("ke") == nil)
+	x:set(-7, "key")
+	assert(x:get("key") == -7)
+	assert(#x == 2)
+	x:set(nil, "key")
+	x:set(nil, "absent")
+	assert(x:get("key") == nil)
+	assert(#x == 1)
+	local m = memory.create(8)
+	for i = 1, 10000 do
+		memory.pack(m, "j", 1, i)
+		x:set(i % 3 == 0 and tostring(i) or i, m)
+	end
+	assert(#x == 10001)
+	for i = 1, 10000, 2 do
+		memory.pack(m, "j", 1, i)
+		x:set(nil, m)
+	end
+	assert(#x == 5001)
+	for i = 1, 10000 do
+		memory.pack(m, "j", 1, i)
+		local v = x:get(m)
+		if i % 2 == 1 then assert(v == nil)
+		elseif i % 3 == 0 then assert(v == tostring(i))
+		else assert(v == i) end
+	end
+	for i = 1, 1000 do
+		x:set(i, string.rep("k", i))
+		x:set(nil, string.rep("k", i))
+	end
+	assert(#x == 5001)
+	x:clear()
+	assert(#x == 0)
+	assert(x:get(m) == nil)
+	x:set(x, "self")
+	assert(x:get("self") == x)
+	asserterr("bad argument", x.set, x)
+	asserterr("string or memory expected", x.get, x, {})
+end
+
+do print "memory.sort(m, recsize, keyoffset, keyfmt [, i [, j]]), memory.bsearch(m, recsize, keyoffset, keyfmt, key [, i [, j]])"
+	local values = {}
+	local m = memory.create(1000 * 12)
+	for k = 1, 1000 do
+		local v = (k * 7919) % 1000 - 500
+		values[k] = v
+		memory.pack(m, ">i4<I8", (k-1)*12+1, v * 65536, k)
+	end
+	memory.sort(m, 12, 0, ">i4")
+	table.sort(values)
+	local last = {}
+	for k = 1, 1000 do
+		local v, n = memory.unpack(m, ">i4<I8", (k-1)*12+1)
+		assert(v == values[k] * 65536)
+		if last[v] then assert(n > last[v]) end  -- stable
+		last[v] = n
+	end
+	assert(memory.bsearch(m, 12, 0, ">i4", values[1] * 65536) == 1)
+	assert(memory.bsearch(m, 12, 0, ">i4", values[1000] * 65536) == 999*12+1)
+	local pos = memory.bsearch(m, 12, 0, ">i4", 0)
+	assert(memory.unpack(m, ">i4", pos) == 0)
+	assert(pos == 1 or memory.unpack(m, ">i4", pos-12) < 0)
+	local res, pos = memory.bsearch(m, 12, 0, ">i4", 1)
+	assert(res == nil and memory.unpack(m, ">i4", pos) > 1)
+	res, pos = memory.bsearch(m, 12, 0, ">i4", 1 << 30)
+	assert(res == nil and pos == #m+1)
+
+	memory.sort(m, 12, 4, "<I8")
+	for k = 1, 1000 do
+		assert(memory.unpack(m, "<I8", (k-1)*12+5) == k)
+	end
+	assert(memory.bsearch(m, 12, 4, "<I8", 10) == 9*12+1)
+
+	m = memory.create("dbcaxx")
+	memory.sort(m, 1, 0, "c1", 1, 4)
+	assert(tostring(m) == "abcdxx")
+	m = memory.create("b2a1c3a0")
+	memory.sort(m, 2, 0, "c1")
+	assert(tostring(m) == "a1a0b2c3")
+	memory.sort(m, 2, 0, "c2")
+	assert(tostring(m) == "a0a1b2c3")
+	assert(memory.bsearch(m, 2, 0, "c2", "b2") == 5)
+	res, pos = memory.bsearch(m, 2, 0, "c2", "b0")
+	assert(res == nil and pos == 5)
+	res, pos = memory.bsearch(m, 2, 0, "c2", "a1", 5)
+	assert(res == nil and pos == 5)
+	res, pos = memory.bsearch("", 2, 0, "c2", "a1")
+	assert(res == nil and pos == 1)
+
+	m = memory.create(8 * 6)
+	memory.pack(m, "dddddd", 1, 1.5, -2, 0, -0.5, 1e100, -1e100)
+	memory.sort(m, 8, 0, "d")
+	assert(assertret({-1e100, -2, -0.5, 0, 1.5, 1e100}, memory.unpack(m, "dddddd")) == 49)
+	assert(memory.bsearch(m, 8, 0, "d", -0.5) == 17)
+
+	asserterr("memory expected", memory.sort, "abcd", 1, 0, "B")
+	asserterr("invalid key format", memory.sort, m, 8, 0, "s")
+	asserterr("invalid key format", memory.sort, m, 8, 0, "i4i4")
+	asserterr("key out of record", memory.sort, m, 8, 1, "i8")
+	asserterr("invalid record size", memory.sort, m, 0, 0, "B")
+	asserterr("range is not a multiple of record size", memory.sort, m, 5, 0, "B")
+	asserterr("wrong length", memory.bsearch, m, 8, 0, "c8", "x")
+end
+
+do print "memory.fill(m, s) with patterns of different lengths"
+	for _, len in ipairs{1, 2, 3, 7, 16, 100, 5000} do
+		local s = {}
+		for k = 1, len do s[k] = string.char(k % 251) end
+		s = table.concat(s)
+		for _, size in ipairs{1, len-1, len, len+1, 3*len+5, 40000} do
+			if size > 0 then
+				local expected = string.rep(s, size//len + 2)
+				local m = memory.create(size)
+				memory.fill(m, s)
+				assert(tostring(m) == expected:sub(1, size))
+				if len > 1 then
+					local t = string.rep(s:sub(2), size//(len-1) + 1)
+					memory.fill(m, s, 2, -1, 2)
+					assert(tostring(m) == expected:sub(1, 1)..t:sub(1, size-1))
+				end
+				memory.fill(m, s, 2, -1, 1)
+				assert(tostring(m) == expected:sub(1, 1)..expected:sub(1, size-1))
+			end
+		end
+	end
+end
+
+do print "memory.utf8valid/utf8len/utf8codes(m [, i [, j]])"
+	local text = "ação: \u{10FFFF} 日本語 \u{7FF}\u{800}\u{FFFF}\u{10000}"
+	local m = memory.create(string.rep(text, 10))
+	assert(memory.utf8valid(m) == true)
+	assert(memory.utf8len(m) == 10 * utf8.len(text))
+	assert(memory.utf8len(text, 3) == nil)
+	assert(memory.utf8len(text, 4) == utf8.len(text, 4))
+	assert(memory.utf8len("") == 0)
+	assert(memory.utf8len(m, 5, 4) == 0)
+	local t = {}
+	for p, c in memory.utf8codes(m, 1, #text) do t[#t+1] = p; t[#t+1] = c end
+	local e = {}
+	for p, c in utf8.codes(text) do e[#e+1] = p; e[#e+1] = c end
+	assert(table.concat(t, ",") == table.concat(e, ","))
+	t = {}
+	for p, c in memory.utf8codes(text, 4, 5) do t[#t+1] = p; t[#t+1] = c end
+	assert(table.concat(t, ",") == "4,227")
+	t = {}
+	for p, c in memory.utf8codes(text, -#text + 3, 6) do t[#t+1] = p; t[#t+1] = c end
+	assert(table.concat(t, ",") == "4,227,6,111")
+	asserterr("invalid UTF-8 code", memory.utf8codes(text, 3))
+
+	for _, bad in ipairs{
+		"\x80", "\xC1\xBF", "\xC2", "\xE0\x9F\xBF", "\xED\xA0\x80",
+		"\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xE2\x82", "\xFF",
+	} do
+		local s = string.rep("x", 37)..bad.."yz"
+		local res, pos = memory.utf8valid(s)
+		assert(res == nil and pos == 38)
+		res, pos = memory.utf8len(memory.create(s))
+		assert(res == nil and pos == 38)
+		assert(memory.utf8len(s, 1, 37) == 37)
+		asserterr("invalid UTF-8 code", function ()
+			for _ in memory.utf8codes(s) do end
+		end)
+	end
+end
+
+do print "memory.split(m, d [, i [, j [, t]]]), memory.lines(m [, i [, j [, t]]])"
+	local function collect(...)
+		local r = {}
+		for i, j in ... do r[#r+1] = i..":"..j end
+		return table.concat(r, " ")
+	end
+	local m = memory.create("a,bc,,d,")
+	assert(collect(memory.split(m, ",")) == "1:1 3:4 6:5 7:7 9:8")
+	assert(collect(memory.split(m, ",", 3, 6)) == "3:4 6:5 7:6")
+	assert(collect(memory.split(m, "bc")) == "1:2 5:8")
+	assert(collect(memory.split("", ",")) == "1:0")
+	assert(collect(memory.split("abc", ",", 3, 2)) == "3:2")
+	assert(collect(memory.lines("one\n\nthree\n")) == "1:3 5:4 6:10")
+	assert(collect(memory.lines("one\ntwo")) == "1:3 5:7")
+	assert(collect(memory.lines("")) == "")
+	assert(collect(memory.lines("\n")) == "1:0")
+
+	local t = {}
+	assert(memory.split(m, ",", 1, -1, t) == 5)
+	assert(table.concat(t, ",") == "1,1,3,4,6,5,7,7,9,8")
+	t = {}
+	assert(memory.lines(memory.create("x\ny\n"), nil, nil, t) == 2)
+	assert(table.concat(t, ",") == "1,1,3,3")
+
+	local big = memory.create(string.rep("field,", 1000))
+	local n = 0
+	for i, j in memory.split(big, ",") do
+		n = n + 1
+		if n <= 1000 then assert(memory.tostring(big, i, j) == "field") end
+	end
+	assert(n == 1001)
+
+	asserterr("empty delimiter", memory.split, m, "")
+	asserterr("table expected", memory.split, m, ",", 1, -1, 0)
+end
+
+do print "memory.bitset/bitclear/bittest(m, bit), memory.popcount(m [, i [, j]]), memory.nextbit(m [, from [, value]])"
+	local m = memory.create(100)
+	assert(memory.popcount(m) == 0)
+	assert(memory.nextbit(m) == nil)
+	assert(memory.nextbit(m, 1, false) == 1)
+	assert(memory.bitset(m, 1) == false)
+	assert(memory.bitset(m, 1) == true)
+	assert(memory.bitset(m, 10) == false)
+	assert(memory.bitset(m, 800) == false)
+	assert(memory.get(m, 1) == 1 and memory.get(m, 2) == 2 and memory.get(m, 100) == 128)
+	assert(memory.bittest(m, 10) == true)
+	assert(memory.bittest(m, 11) == false)
+	assert(memory.bittest(tostring(m), 800) == true)
+	assert(memory.popcount(m) == 3)
+	assert(memory.popcount(m, 2) == 2)
+	assert(memory.popcount(m, 2, 99) == 1)
+	assert(memory.popcount("\xff\x0f") == 12)
+	assert(memory.nextbit(m) == 1)
+	assert(memory.nextbit(m, 2) == 10)
+	assert(memory.nextbit(m, 11) == 800)
+	assert(memory.nextbit(m, 801) == nil)
+	assert(memory.nextbit(m, 1000) == nil)
+	assert(memory.nextbit(m, 2, false) == 2)
+	assert(memory.bitclear(m, 10) == true)
+	assert(memory.bitclear(m, 10) == false)
+	assert(memory.nextbit(m, 2) == 800)
+	memory.fill(m, "\xff")
+	assert(memory.popcount(m) == 800)
+	assert(memory.nextbit(m, 1, false) == nil)
+	memory.bitclear(m, 777)
+	assert(memory.nextbit(m, 3, false) == 777)
+	asserterr("index out of bounds", memory.bitset, m, 0)
+	asserterr("index out of bounds", memory.bitset, m, 801)
+	asserterr("index out of bounds", memory.bittest, "", 1)
+	asserterr("memory expected", memory.bitset, "abc", 1)
+end
+
+do print "memory.totable(m [, i [, j [, width [, t]]]]), memory.fromtable(m, i, t [, width])"
+	local m = memory.create("\1\2\3\4\255\0\0\128")
+	local t, n = memory.totable(m)
+	assert(n == 8 and #t == 8 and t[1] == 1 and t[5] == 255 and t[8] == 128)
+	local r = {}
+	assert(memory.totable(m, 2, 5, 1, r) == r)
+	assert(table.concat(r, ",") == "2,3,4,255")
+	t, n = memory.totable(m, 1, -1, 2)
+	assert(n == 4 and t[1] == string.unpack("=I2", "\1\2") and t[3] == 255)
+	t, n = memory.totable(tostring(m), 1, -1, 4)
+	assert(n == 2 and t[1] == string.unpack("=I4", "\1\2\3\4"))
+	assert(t[2] == string.unpack("=I4", "\255\0\0\128"))
+	t, n = memory.totable(m, 3, 2)
+	assert(n == 0 and next(t) == nil)
+
+	local f = memory.create(8)
+	assert(memory.fromtable(f, 1, {1, 2, 3, 4, 255, 0, 0, 128}) == 8)
+	assert(memory.diff(f, m) == nil)
+	assert(memory.fromtable(f, 5, {0xffff, 0x1234}, 2) == 4)
+	assert(memory.tostring(f, 5) == string.pack("=I2I2", 0xffff, 0x1234))
+	assert(memory.fromtable(f, 1, {0xfffffffe}, 4) == 4)
+	assert(memory.tostring(f, 1, 4) == string.pack("=I4", 0xfffffffe))
+	assert(memory.fromtable(f, 9, {}) == 0)
+	asserterr("memory too small", memory.fromtable, f, 8, {1, 2})
+	asserterr("invalid value (at index 2) in table", memory.fromtable, f, 1, {1, 256})
+	asserterr("invalid value (at index 1) in table", memory.fromtable, f, 1, {-1})
+	asserterr("invalid value (at index 1) in table", memory.fromtable, f, 1, {1.5})
+	asserterr("invalid value (at index 1) in table", memory.fromtable, f, 1, {0x10000}, 2)
+	local snapshot = tostring(f)
+	asserterr("invalid value (at index 3) in table", memory.fromtable, f, 1, {9, 9, "x"})
+	assert(tostring(f) == snapshot)  -- left unchanged
+	local r = newresizable("ab")
+	asserterr("invalid value (at index 2) in table", memory.fromtable, r, 3, {1, 1000})
+	assert(tostring(r) == "ab")
+	asserterr("invalid width", memory.totable, f, 1, -1, 3)
+	asserterr("range is not a multiple of width", memory.totable, f, 1, 7, 2)
+
+	local big = {}
+	for k = 1, 100000 do big[k] = k % 65536 end
+	local b = memory.create()
+	assert(memory.fromtable(b, 1, big, 2) == 200000)
+	t, n = memory.totable(b, 1, -1, 2)
+	assert(n == 100000 and t[100000] == big[100000] and t[65536] == 0)
+end
+
+do print "memory.encode(m, i, v [, d]), memory.decode(m [, i [, d]])"
+	local function encode(v, d)
+		local m = memory.create()
+		assert(memory.encode(m, 1, v, d) == #m+1)
+		return tostring(m)
+	end
+	assert(encode(nil) == "\xc0")
+	assert(encode(true) == "\xc3" and encode(false) == "\xc2")
+	assert(encode(127) == "\x7f" and encode(128) == "\xcc\x80")
+	assert(encode(65536) == "\xce\0\1\0\0")
+	assert(encode(-32) == "\xe0" and encode(-33) == "\xd0\xdf")
+	assert(encode(math.mininteger) == "\xd3\x80\0\0\0\0\0\0\0")
+	assert(encode(1.5) == "\xca\x3f\xc0\0\0")
+	assert(encode(0.1) == "\xcb\x3f\xb9\x99\x99\x99\x99\x99\x9a")
+	assert(encode("abc") == "\xa3abc")
+	assert(encode(string.rep("y", 32)) == "\xd9\x20"..string.rep("y", 32))
+	assert(encode(memory.create("b\0")) == "\xc4\2b\0")
+	assert(encode({1, 2, 3}) == "\x93\1\2\3")
+	assert(encode({a = 1}) == "\x81\xa1a\1")
+	assert(encode({}) == "\x80")
+	assert(encode({[1] = 1, [3] = 3}):sub(1, 1) == "\x82")
+	local holes = {1, 2, 3, 4}
+	holes[2] = nil
+	holes.x = 1
+	assert(encode(holes):sub(1, 1) == "\x84")
+	local v = memory.decode(encode(holes))
+	assert(v[1] == 1 and v[2] == nil and v[3] == 3 and v[4] == 4 and v.x == 1)
+
+	local value = {
+		id = 42, name = "name", list = {1, -1, 2.5, "x", true, false},
+		nested = {deep = {deeper = {}}, [10] = "ten"},
+	}
+	local m = memory.create()
+	local pos = memory.encode(m, 1, value)
+	pos = memory.encode(m, pos, "next")
+	local v, p = memory.decode(m)
+	assert(v.id == 42 and v.name == "name" and #v.list == 6)
+	assert(v.list[2] == -1 and v.list[3] == 2.5 and v.list[4] == "x")
+	assert(v.list[5] == true and v.list[6] == false)
+	assert(v.nested[10] == "ten" and next(v.nested.deep.deeper) == nil)
+	assert(assertret({"next"}, memory.decode(m, p)) == #m+1)
+	v, p = memory.decode("\xc0")
+	assert(v == nil and p == 2)
+	assert(assertret({"b\0"}, memory.decode("\xc4\2b\0")) == 5)
+	assert(assertret({-1}, memory.decode(memory.create("\xd0\xff"))) == 3)
+	assert(assertret({0xffff}, memory.decode("\xcd\xff\xff")) == 4)
+	assert(assertret({-2}, memory.decode("\xd2\xff\xff\xff\xfe")) == 6)
+	assert(assertret({2.5}, memory.decode("\xca\x40\x20\0\0")) == 6)
+
+	local fixed = memory.create(4)
+	assert(memory.encode(fixed, 2, {1, 2}) == 5)
+	assert(memory.tostring(fixed, 2) == "\x92\1\2")
+	asserterr("memory too small", memory.encode, fixed, 3, {1, 2})
+	local r = newresizable("head")
+	assert(memory.encode(r, 5, "tail") == 10)
+	assert(tostring(r) == "head\xa4tail")
+	assert(memory.encode(r, 1, 1) == 2)
+	assert(tostring(r) == "\1ead\xa4tail")
+	local r = newresizable(string.rep("a", 100))
+	assert(memory.encode(r, #r+1, r) == 100+2+100+1)
+	assert(memory.tostring(r, 101) == "\xc4\100"..string.rep("a", 100))
+	local r = newresizable("abc")
+	asserterr("cannot encode a function value", memory.encode, r, 4, {1, 2, print})
+	assert(#r == 3 and tostring(r) == "abc")
+	asserterr("cannot encode a function value", memory.encode, r, 2, {string.rep("x", 200), print})
+	assert(#r == 3)
+	assert(memory.encode(r, 2, {string.rep("x", 200)}) == 2+1+2+200)
+	assert(tostring(r) == "a\x91\xd9\200"..string.rep("x", 200))
+
+	local prev, dprev = {}, {}
+	local msg = {"repeated", "repeated", {repeated = "repeated"}, "abc", "abc"}
+	local first = encode(msg, prev)
+	assert(#first < #encode(msg))
+	assert(prev[1] == "repeated" and prev.repeated == 1 and prev.abc == nil)
+	local second = encode(msg, prev)
+	assert(#second == 2 + 4*3 + 8)
+	v = memory.decode(first, 1, dprev)
+	assert(v[2] == "repeated" and v[3].repeated == "repeated" and v[5] == "abc")
+	v = memory.decode(second, 1, dprev)
+	assert(v[1] == "repeated" and v[3].repeated == "repeated")
+	asserterr("table of strings expected", memory.decode, second)
+	asserterr("invalid string reference", memory.decode, "\xd4\x7f\9", 1, {})
+	local function count(t)
+		local n = 0
+		for _ in pairs(t) do n = n+1 end
+		return n
+	end
+	asserterr("cannot encode a function value", memory.encode, memory.create(), 1,
+	          {"fresh one", "repeated", "fresh two", print}, prev)
+	assert(count(prev) == 2 and prev["fresh one"] == nil)  -- left unchanged
+	asserterr("data too short", memory.decode, "\x92\xa4news", 1, dprev)
+	assert(count(dprev) == 2 and dprev.news == nil)
+	v = memory.decode("\x93\xa4news\xd4\x7f\2\xd4\x7f\1", 1, dprev)
+	assert(v[1] == "news" and v[2] == "news" and v[3] == "repeated")
+	assert(dprev[2] == "news" and dprev.news == 2)
+	assert(encode({"fresh", "fresh"}, prev) == "\x92\xa5fresh\xd4\x7f\2")
+	assert(prev[2] == "fresh" and prev.fresh == 2)
+
+	local cycle = {}
+	cycle[1] = cycle
+	asserterr("table too deep", memory.encode, memory.create(), 1, cycle)
+	asserterr("cannot encode a function value", memory.encode, memory.create(), 1, print)
+	asserterr("data too short at position 2", memory.decode, "\x92\1")
+	asserterr("data too short at position 6", memory.decode, "\xdd\xff\xff\xff\xff")
+	asserterr("invalid type at position 1", memory.decode, "\xc1")
+	asserterr("invalid table key at position 2", memory.decode, "\x81\xc0\1")
+	asserterr("unsupported extension", memory.decode, "\xd4\1\1")
+	asserterr("index out of bounds", memory.decode, "", 2)
+end
+
+if memory.aio then print "memory.aio([size [, mode]])"
+	asserterr("invalid size", memory.aio, 0)
+	asserterr("invalid option", memory.aio, 1, "epoll")
+	for _, mode in ipairs{"threads", "auto"} do
+		local c = memory.aio(4, mode)
+		local m = memory.create()
+		memory.resize(m, 10)
+		assert(#c == 0)
+		local r = c:read(-1, m)
+		local w = c:write(-1, "abc", 2)
+		assert(r ~= w)
+		assert(#c == 2)
+		asserterr("pending operations", memory.resize, m, 20)
+		asserterr("pending operations", memory.release, m)
+		assert(memory.len(m) == 10)
+		asserterr("too many pending operations", function ()
+			for i = 1, 3 do c:write(-1, "abc") end
+		end)
+		assert(c:submit() == 4)
+		assert(c:submit() == 0)
+		local t, n = {}, 0
+		while #c > 0 do
+			local _, k = c:wait(#c, t)
+			n = n+k
+		end
+		assert(n == 4)
+		assert(t[r] == t[w])
+		memory.resize(m, 20)  -- no more pending operations
+		assert(memory.len(m) == 20)
+		assert(type(t[r]) == "string")
+		local _, n = c:wait()
+		assert(n == 0)
+		asserterr("invalid offset", c.read, c, -1, m, 1, -1, -2)
+		asserterr("memory expected", c.read, c, -1, "abc")
+		c:write(-1, "abc")
+		c:write(-1, m)
+		c:close()
+		memory.release(m)  -- discarded operations are not pending
+		assert(memory.len(m) == 0)
+		asserterr("closed context", c.submit, c)
+		asserterr("closed context", function () return #c end)
+		local weak = setmetatable({}, {__mode = "k"})
+		local function discard()
+			local c = memory.aio(4, mode)
+			c:write(-1, "abc")
+			c:close()
+			weak[c] = true
+		end
+		discard()
+		collectgarbage()
+		collectgarbage()  -- keys with finalizers are removed in the next cycle
+		assert(next(weak) == nil)  -- discarded operations do not keep it
+	end
+	collectgarbage()
+
+	-- find the descriptor of a file by reading its contents from all of them
+	local name = os.tmpname()
+	local f = assert(io.open(name, "w+b"))
+	local marker = "\0luamem\0"
+	f:setvbuf("no")  -- so seeks set the position of the descriptor
+	f:write(marker)
+	local fd
+	do
+		local c = memory.aio(256, "threads")
+		local m = memory.create(256*#marker)
+		local ids = {}
+		for k = 0, 255 do ids[k] = c:read(k, m, k*#marker+1, (k+1)*#marker, 0) end
+		local t = c:wait(256)
+		for k = 0, 255 do
+			if t[ids[k]] == #marker and
+			   memory.tostring(m, k*#marker+1, (k+1)*#marker) == marker then
+				fd = k
+				break
+			end
+		end
+		assert(fd, "descriptor of the file not found")
+	end
+	local modes = {"threads", "auto"}
+	if pcall(memory.aio, 1, "io_uring") then table.insert(modes, "io_uring") end
+	for _, mode in ipairs(modes) do
+		local c = memory.aio(8, mode)
+		local w1 = c:write(fd, "0123456789", 1, -1, 0)
+		local w2 = c:write(fd, memory.create("abcdef"), 2, 4, 20)
+		local t, n = c:wait(2)
+		assert(n == 2 and t[w1] == 10 and t[w2] == 3)
+		local m = memory.create(8)
+		local r1 = c:read(fd, m, 1, 4, 2)
+		local r2 = c:read(fd, m, 5, 8, 21)  -- only 2 bytes before the end
+		t, n = c:wait(2)
+		assert(n == 2 and t[r1] == 4 and t[r2] == 2)
+		assert(memory.tostring(m, 1, 6) == "2345cd")
+		assert(f:seek("set", 5) == 5)  -- operations without offset use it
+		local r = c:read(fd, m, 1, 3)
+		assert(c:wait()[r] == 3 and memory.tostring(m, 1, 3) == "567")
+		r = c:read(fd, m, 4, 6)
+		assert(c:wait()[r] == 3 and memory.tostring(m, 1, 6) == "56789\0")
+		local w = c:write(fd, "XY")
+		assert(c:wait()[w] == 2)
+		r = c:read(fd, m, 1, 4, 10)
+		assert(c:wait()[r] == 4 and memory.tostring(m, 1, 4) == "\0XY\0")
+		r = c:read(fd, m, 1, -1, 100)
+		assert(c:wait()[r] == 0)
+		c:close()
+	end
+	f:close()
+	os.remove(name)
+end
+
 print "OK"